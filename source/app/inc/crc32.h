@@ -0,0 +1,95 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//                              Includes
+//////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////////
+//                             Macros
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * Build options:
+ *  - CRC32_NO_HW: never use the carry-less multiply (x86 PCLMULQDQ) or ARMv8 CRC
+ *    instructions, the slicing-by-8 tables are always used.
+ *
+ * The ARMv8 path is selected at build time (__ARM_FEATURE_CRC32, e.g. -march=armv8-a+crc),
+ * the PCLMULQDQ path is selected at run time on x86 when the CPU supports it.
+ */
+
+//////////////////////////////////////////////////////////////////////
+//                      Public Functions declaration
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @name crc32_calculate
+ * @brief Calculates the IEEE 802.3 CRC32 (reflected 0xEDB88320, init and final xor 0xFFFFFFFF) of a buffer.
+ * 
+ * @details Uses the fastest implementation available on the target, every
+ *          implementation returns the same value.
+ * 
+ * @param[in] pData Pointer to the data.
+ * @param[in] len Length of the data in bytes.
+ * 
+ * @return The calculated 32-bit CRC value.
+ */
+uint32_t crc32_calculate(const void* pData, size_t len);
+
+/**
+ * @name crc32_update
+ * @brief Continues a CRC32 calculation over another buffer.
+ * 
+ * @details crc32_update(crc32_calculate(a, lenA), b, lenB) equals the CRC of a followed by b,
+ *          crc32_update(0, pData, len) equals crc32_calculate(pData, len).
+ * 
+ * @param[in] crc CRC32 of the preceding data, 0 to start a new calculation.
+ * @param[in] pData Pointer to the data.
+ * @param[in] len Length of the data in bytes.
+ * 
+ * @return The calculated 32-bit CRC value.
+ */
+uint32_t crc32_update(uint32_t crc, const void* pData, size_t len);
+
+/**
+ * @name crc32_calculate_sliced
+ * @brief Calculates the CRC32 of a buffer with the slicing-by-8 tables only.
+ * 
+ * @param[in] pData Pointer to the data.
+ * @param[in] len Length of the data in bytes.
+ * 
+ * @return The calculated 32-bit CRC value.
+ */
+uint32_t crc32_calculate_sliced(const void* pData, size_t len);
+
+/**
+ * @name crc32_calculate_bitwise
+ * @brief Reference bit-at-a-time CRC32, kept to verify and benchmark the other implementations.
+ * 
+ * @param[in] pData Pointer to the data.
+ * @param[in] len Length of the data in bytes.
+ * 
+ * @return The calculated 32-bit CRC value.
+ */
+uint32_t crc32_calculate_bitwise(const void* pData, size_t len);
+
+/**
+ * @name crc32_implementation
+ * @brief Names the implementation used by crc32_calculate on this target.
+ * 
+ * @return "pclmul", "armv8" or "slicing-by-8".
+ */
+const char* crc32_implementation();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CRC32_H
\ No newline at end of file
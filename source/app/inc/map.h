@@ -9,6 +9,7 @@ extern "C" {
 //                              Includes
 //////////////////////////////////////////////////////////////////////
 
+#include <stddef.h>
 #include <stdint.h>
 
 //////////////////////////////////////////////////////////////////////
@@ -17,6 +18,7 @@ extern "C" {
 
 #define MAP_MAX_KEY_LEN 32		  /// Maximum length of a key string.
 #define MAP_MAX_VAL_LEN_STR 64	  /// Maximum length of a string value.
+#define MAP_MAX_KEYS 128		  /// Maximum number of distinct keys held by the map.
 #define ENTRY_NOT_DELETED_VALUE 0 /// Value indicating that an entry is not deleted.
 #define ENTRY_DELETED_VALUE 1	  /// Value indicating that an entry has been marked as deleted.
 
@@ -37,15 +39,68 @@ typedef struct map_entry
 } __attribute__((__packed__)) map_entry_t;
 
 /**
- * @brief Linked list that contains all the -valid- mapped values stored in flash
+ * @brief Key-value pair handed to map_add_entries, a NULL pValStr makes it a uint32_t entry.
+ */
+typedef struct map_kv
+{
+	const char* pKey;
+	const char* pValStr;
+	uint32_t	valueU32;
+} map_kv_t;
+
+/**
+ * @brief Told that the entries flushed by map_store_all_async are durable, called from the I/O context.
+ *        It must not call back into the map.
+ * 
+ * @param status 0 on success, -1 on failure.
+ * @param pCtx Context given to map_store_all_async.
+ */
+typedef void (*map_flush_done_cb_t)(int8_t status, void* pCtx);
+
+/**
+ * @brief Counters of the cache of values read from flash, see map_get_cache_stats.
+ */
+typedef struct map_cache_stats
+{
+	uint32_t hits;		/// Values served from the cache
+	uint32_t misses;	/// Values read from flash
+	uint32_t evictions; /// Cached values dropped to make room for another
+} map_cache_stats_t;
+
+/**
+ * @brief Handle of the map handed to every function.
+ *        The latest value of every key is held in contiguous arrays inside the map module,
+ *        the handle only identifies the map, use map_iter_begin to visit the keys.
  */
 typedef struct map_entry_log
 {
-	map_entry_t			  entry;
-	uint8_t				  latestEntry;
-	struct map_entry_log* next;
+	struct map_entry_log* next; /// Deprecated, always NULL since the keys are no longer chained
 } map_entry_log_t;
 
+/**
+ * @brief Latest entry of a key as yielded by map_iter_next, pointing into the map instead of copying it.
+ */
+typedef struct map_entry_view
+{
+	const char* key;	  /// Key of the entry
+	const char* valueStr; /// Value of a string entry
+	uint8_t		type;	  /// Same as map_entry_t.type
+	uint32_t	valueU32; /// Value of a uint32_t entry
+} map_entry_view_t;
+
+/**
+ * @brief Cursor over the keys of the map, see map_iter_begin.
+ */
+typedef struct map_iter
+{
+	uint16_t		 numYielded; /// Keys yielded so far
+	uint8_t			 locked;	 /// Set while the iterator holds the lock of MAP_THREAD_SAFE
+	map_entry_view_t view;		 /// View of the last key yielded
+#ifdef MAP_LAZY_VALUES
+	map_entry_t entry; /// Entry read back from flash when the value cache does not hold it
+#endif
+} map_iter_t;
+
 //////////////////////////////////////////////////////////////////////
 //                      Public Functions declaration
 //////////////////////////////////////////////////////////////////////
@@ -54,7 +109,7 @@ typedef struct map_entry_log
  * @name map_init
  * @brief Initializes the map module and reads existing entries from storage.
  * 
- * @param[out] pMapLog Pointer to the head of the map entry linked list to be populated.
+ * @param[out] pMapLog Pointer to the map handle to be populated.
  * 
  * @retval 0 on success, -1 on failure.
  */
@@ -64,7 +119,7 @@ int8_t map_init(map_entry_log_t* pMapLog);
  * @name map_deInit
  * @brief De-initializes the map, freeing allocated memory and closing storage.
  * 
- * @param[in] pMapLog Pointer to the head of the map entry linked list to be cleared.
+ * @param[in] pMapLog Pointer to the map handle to be cleared.
  * 
  * @retval 0 on success, -1 on failure.
  */
@@ -78,6 +133,53 @@ int8_t map_deInit(map_entry_log_t* pMapLog);
  */
 int8_t map_store_all();
 
+/**
+ * @name map_store_all_async
+ * @brief Starts flushing the buffered map entries and returns without waiting for flash.
+ * 
+ * @details pDoneCb is called once the entries are durable, right away when nothing is buffered.
+ *          A checkpoint due is left to the next map_store_all.
+ *          Refused while the flusher thread of map_async_start runs, map_sync is the barrier then.
+ * 
+ * @param[in] pDoneCb Called when the entries are durable, may be NULL.
+ * @param[in] pCtx Handed to pDoneCb.
+ * 
+ * @retval 0 if the flush was started, -1 on failure (pDoneCb is not called).
+ */
+int8_t map_store_all_async(map_flush_done_cb_t pDoneCb, void* pCtx);
+
+/**
+ * @name map_async_start
+ * @brief Starts a flusher thread that stores and flushes entries in the background.
+ * 
+ * @details While it runs, map_add_entry_val_str and map_add_entry_val_u32 only encode the entry
+ *          into a lock-free queue and return. Any number of threads may add entries. They show up
+ *          in lookups once the flusher thread has stored them. map_sync waits for that.
+ *          Batches, transactions and map_read_log are refused while the flusher thread runs.
+ *          Requires MAP_THREAD_SAFE.
+ * 
+ * @retval 0 on success, -1 if it is already running, a transaction is open or threads are unavailable.
+ */
+int8_t map_async_start();
+
+/**
+ * @name map_async_stop
+ * @brief Stores and flushes whatever is still queued, then stops the flusher thread.
+ * 
+ * @details No entry may be added while it runs.
+ * 
+ * @retval 0 on success, -1 if it was not running or an entry could not be stored.
+ */
+int8_t map_async_stop();
+
+/**
+ * @name map_sync
+ * @brief Durability barrier, returns once every entry added before the call is flushed to flash.
+ * 
+ * @retval 0 on success, -1 if an entry could not be stored.
+ */
+int8_t map_sync();
+
 /**
  * @name map_add_entry_val_str
  * @brief Adds a new map entry with a string value to storage.
@@ -85,7 +187,7 @@ int8_t map_store_all();
  * @param[in] pKey The key for the new entry.
  * @param[in] pVal The string value for the new entry.
  * 
- * @retval 0 on success, -1 on failure (e.g., key/value too long).
+ * @retval 0 on success, -1 on failure (e.g., key/value too long, a new key while the map holds MAP_MAX_KEYS, or the flusher thread queue is full).
  */
 int8_t map_add_entry_val_str(const char* pKey, const char* pVal);
 
@@ -96,15 +198,54 @@ int8_t map_add_entry_val_str(const char* pKey, const char* pVal);
  * @param[in] pKey The key for the new entry.
  * @param[in] valueU32 The uint32_t value for the new entry.
  * 
- * @retval 0 on success, -1 on failure (e.g., key too long).
+ * @retval 0 on success, -1 on failure (e.g., key too long, a new key while the map holds MAP_MAX_KEYS, or the flusher thread queue is full).
  */
 int8_t map_add_entry_val_u32(const char* pKey, uint32_t valueU32);
 
+/**
+ * @name map_add_entries
+ * @brief Adds several map entries and commits them to storage with a single flush.
+ * 
+ * @param[in] pEntries Entries to be added, in order.
+ * @param[in] numEntries Number of entries.
+ * 
+ * @retval 0 on success, -1 on failure (nothing is added when a key or value is too long, or the map has no room for the new keys).
+ */
+int8_t map_add_entries(const map_kv_t* pEntries, size_t numEntries);
+
+/**
+ * @name map_tx_begin
+ * @brief Starts a transaction, entries added until map_tx_commit are applied all together or not at all.
+ * 
+ * @details Entries added inside the transaction are not visible through the map until it is committed.
+ * 
+ * @retval 0 on success, -1 if a transaction is already open.
+ */
+int8_t map_tx_begin();
+
+/**
+ * @name map_tx_commit
+ * @brief Stores the commit marker of the open transaction and applies its entries.
+ * 
+ * @retval 0 on success, -1 on failure (the transaction is then ignored on the next map_read_log).
+ */
+int8_t map_tx_commit();
+
+/**
+ * @name map_tx_abort
+ * @brief Drops the entries added since map_tx_begin.
+ * 
+ * @retval 0 on success, -1 if no transaction is open.
+ */
+int8_t map_tx_abort();
+
 /**
  * @name map_get_entry_via_num
  * @brief Retrieves a map entry from the in-memory log by its sequential index.
  * 
- * @param[in] pMapLog Pointer to the head of the map entry linked list.
+ * @details Keys are numbered in order of first appearance, a deleted key shifts the ones after it.
+ * 
+ * @param[in] pMapLog Pointer to the map handle.
  * @param[in] entryNum The zero-based index of the entry to retrieve.
  * @param[out] pEntry Pointer to a map_entry_t struct to be filled with the data.
  * 
@@ -116,7 +257,10 @@ int8_t map_get_entry_via_num(map_entry_log_t* pMapLog, uint16_t entryNum, map_en
  * @name map_get_entry_via_key
  * @brief Retrieves the latest map entry from the in-memory log by its key.
  * 
- * @param[in] pMapLog Pointer to the head of the map entry linked list.
+ * @details Built with MAP_THREAD_SAFE it may be called from any number of threads while one
+ *          thread adds entries, it never waits for a flush. Writers still run one at a time.
+ * 
+ * @param[in] pMapLog Pointer to the map handle.
  * @param[in] key The key of the entry to retrieve.
  * @param[out] pEntry Pointer to a map_entry_t struct to be filled with the data.
  * 
@@ -124,14 +268,72 @@ int8_t map_get_entry_via_num(map_entry_log_t* pMapLog, uint16_t entryNum, map_en
  */
 int8_t map_get_entry_via_key(map_entry_log_t* pMapLog, const char* key, map_entry_t* pEntry);
 
+/**
+ * @name map_iter_begin
+ * @brief Starts walking the latest value of every key, in order of first appearance.
+ * 
+ * @details Built with MAP_THREAD_SAFE the iterator holds the lock shared, writers wait until
+ *          map_iter_end. Otherwise the map must not be written until then.
+ * 
+ * @param[in] pMapLog Pointer to the map handle.
+ * @param[out] pIter Iterator to be started.
+ * 
+ * @retval 0 on success, -1 if pMapLog is not the list built by map_read_log (map_iter_end is not needed then).
+ */
+int8_t map_iter_begin(map_entry_log_t* pMapLog, map_iter_t* pIter);
+
+/**
+ * @name map_iter_next
+ * @brief Steps to the next key in constant time, without copying its entry.
+ * 
+ * @details The view points into the arrays of the map. With MAP_LAZY_VALUES it points into
+ *          the value cache, or into the iterator when the entry had to be read back from flash.
+ * 
+ * @param[in,out] pIter Iterator started by map_iter_begin.
+ * 
+ * @return View of the entry of the key, valid until the next call into the map, NULL once every key was yielded.
+ */
+const map_entry_view_t* map_iter_next(map_iter_t* pIter);
+
+/**
+ * @name map_iter_end
+ * @brief Ends a walk started by map_iter_begin.
+ * 
+ * @param[in,out] pIter Iterator started by map_iter_begin.
+ */
+void map_iter_end(map_iter_t* pIter);
+
+/**
+ * @name map_get_cache_stats
+ * @brief Copies the counters of the value cache accumulated since the last reset.
+ * 
+ * @details Values are only cached when built with MAP_LAZY_VALUES, the cache takes MAP_CACHE_BYTES of RAM.
+ *          Otherwise every value is held in RAM and the counters stay at zero.
+ * 
+ * @param[out] pStats Receives the counters.
+ */
+void map_get_cache_stats(map_cache_stats_t* pStats);
+
+/**
+ * @name map_reset_cache_stats
+ * @brief Sets the counters of the value cache back to zero.
+ */
+void map_reset_cache_stats();
+
 /**
  * @name map_delete_entry
  * @brief Marks an entry in storage as deleted by creating a new tombstone entry.
  * 
- * @param[in] pMapLog Pointer to the head of the map entry linked list.
+ * @details The tombstone is appended like any entry, nothing is rewritten or erased, and it
+ *          is made durable by the next map_store_all. The key is dropped from the in-memory log
+ *          right away, the garbage collector reclaims its records and the tombstone later on.
+ *          While the flusher thread runs the key may still be queued, so an unknown key is
+ *          accepted and its tombstone is dropped by the flusher thread instead of being stored.
+ * 
+ * @param[in] pMapLog Pointer to the map handle.
  * @param[in] key The key of the entry to delete.
  * 
- * @retval 0 on success, -1 on failure.
+ * @retval 0 on success, -1 on failure (e.g., the key is not in the map, outside of async mode).
  */
 int8_t map_delete_entry(map_entry_log_t* pMapLog, const char* key);
 
@@ -139,22 +341,20 @@ int8_t map_delete_entry(map_entry_log_t* pMapLog, const char* key);
  * @name map_print_log
  * @brief Prints all entries in the in-memory map log to the console.
  * 
- * @param[in] pMapLog Pointer to the head of the map entry linked list.
+ * @param[in] pMapLog Pointer to the map handle.
  */
 void map_print_log(map_entry_log_t* pMapLog);
 
 /**
  * @name map_read_log
- * @brief Reads the entire log from storage and populates the in-memory linked list.
+ * @brief Reads the entire log from storage and populates the in-memory arrays.
  * 
- * @param[out] pMapLog Pointer to the head of the map entry linked list to be populated.
+ * @param[out] pMapLog Pointer to the map handle to be populated.
  * 
  * @retval 0 on success, -1 on failure.
  */
 int8_t map_read_log(map_entry_log_t* pMapLog);
 
-int8_t map_delete_entry(map_entry_log_t* pMapLog, const char* key);
-
 #ifdef __cplusplus
 }
 #endif
@@ -10,8 +10,33 @@
  * 
  *  Header, Payload, Magic Number (Indicates header is valid)
  * 
- *  TODO: Magic number should be a CRC that then is checked to indicate
- *        validity of entry  
+ *  Record format version 2 (written by this version):
+ * 
+ *  | Magic (2) | Version (1) | Payload length (1) | Payload (0..102) | CRC32 of everything before (4) |
+ * 
+ *  Record format version 1 (still read, never written):
+ * 
+ *  | 0xDEADBEEF (4) | Payload (102) | Payload length (4) | CRC32 of the payload (4) |
+ * 
+ *  The log is circular over STORAGE_NUM_SECTORS sectors. Every sector in use starts
+ *  with a sector header holding a sequence number, records never straddle sectors:
+ * 
+ *  | Sector header | Record | Record | ... | erased |
+ * 
+ *  The sector with the lowest sequence number is the tail, the highest one is the
+ *  head where records are appended. When only STORAGE_GC_RESERVE_SECTORS erased
+ *  sectors are left, the garbage collector copies the live records of the tail
+ *  sector to the head and retires the tail sector, so a log that is updated
+ *  constantly never runs out of space.
+ * 
+ *  Logs written before the sector layout (records packed from the first address)
+ *  are migrated to it by storage_init.
+ * 
+ *  The STORAGE_CHECKPOINT_SECTORS sectors after the log hold checkpoints: data of
+ *  the upper layer (e.g. where the latest entry of every key is) together with the
+ *  log position it was taken at, so only the entries after it have to be read on
+ *  the next boot. Checkpoints are appended to one sector, when it is full the other
+ *  one is erased and used.
  * 
  */
 
@@ -26,18 +51,123 @@ extern "C" {
 //                              Includes
 //////////////////////////////////////////////////////////////////////
 
+#include "mx25_flash_driver.h"
 #include <stdint.h>
 
 //////////////////////////////////////////////////////////////////////
 //                             Macros
 //////////////////////////////////////////////////////////////////////
 
-#define MAX_STORAGE_ENTRY_PAYLOAD_LEN 102 /// Maximum size in bytes of the payload
+#define MAX_STORAGE_ENTRY_PAYLOAD_LEN 102					/// Maximum size in bytes of the payload
+#define STORAGE_FIRST_SECTOR 0								/// First flash sector used by the log
+#define STORAGE_NUM_SECTORS 8								/// Number of flash sectors used by the log (at least 6)
+#define STORAGE_GC_RESERVE_SECTORS 1						/// Erased sectors kept for the garbage collector to copy live records into
+#define STORAGE_RESERVED_SPACE (STORAGE_NUM_SECTORS * MX25_FLASH_SECTOR_SIZE)	/// Bytes of flash reserved for the log
+#define STORAGE_RECORD_OVERHEAD 8							/// Bytes added to every payload in flash: record header and CRC32
+#define STORAGE_ITER_WINDOW_SIZE MX25_FLASH_SECTOR_SIZE		/// Bytes read from flash at once by the log iterator (one MX25 sector)
+#define STORAGE_CHECKPOINT_SECTORS 2						/// Sectors after the log holding checkpoints, used alternately
+#define STORAGE_CHECKPOINT_MAX_LEN 1024						/// Maximum size in bytes of the data of a checkpoint
 
 //////////////////////////////////////////////////////////////////////
 //                              Types
 //////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief Sequential reader over the entries of the log.
+ * 
+ * @details Entries are read from flash a window at a time. Payloads returned by
+ *          storage_iter_next point inside the window and stay valid until the next call.
+ */
+typedef struct storage_iter
+{
+	uint32_t entryAddr;							/// Address of the next entry to be returned
+	uint32_t lastAddr;							/// Address of the entry returned last
+	uint16_t sector;							/// Log sector (0 to STORAGE_NUM_SECTORS - 1) holding entryAddr
+	uint32_t windowAddr;						/// Flash address of window[0]
+	uint32_t windowLen;							/// Number of valid bytes in window
+	uint8_t	 window[STORAGE_ITER_WINDOW_SIZE]; /// Copy of the log starting at windowAddr
+} storage_iter_t;
+
+/**
+ * @brief Payload handed to storage_store_entries.
+ */
+typedef struct storage_payload
+{
+	const void* pPayload;
+	uint32_t	payloadLen;
+} storage_payload_t;
+
+/**
+ * @brief I/O and wear counters of the storage layer, see storage_get_stats.
+ * 
+ * @details Write amplification is bytesProgrammed / logicalBytesStored, reads per lookup
+ *          is lookupFlashReads / lookups.
+ */
+typedef struct storage_stats
+{
+	uint32_t flashReads;											 /// Read operations sent to the flash
+	uint32_t bytesRead;												 /// Bytes read from the flash
+	uint32_t pagePrograms;											 /// Page programs sent to the flash
+	uint32_t bytesProgrammed;										 /// Bytes programmed, headers, CRCs, GC copies and checkpoints included
+	uint32_t logicalBytesStored;									 /// Payload bytes handed to storage_store_entry and storage_store_entries
+	uint32_t lookups;												 /// Calls to storage_retrieve_entry_payload
+	uint32_t lookupFlashReads;										 /// Flash reads made by those calls
+	uint32_t crcFailures;											 /// Records, sector headers and checkpoints rejected by their CRC
+	uint32_t gcRuns;												 /// Sectors collected by the garbage collector
+	uint32_t gcBytesCopied;											 /// Payload bytes copied by the garbage collector
+	uint32_t flushes;												 /// Calls to storage_flush that programmed data
+	uint64_t flushTimeNs;											 /// Time spent in those calls
+	uint32_t sectorErases[STORAGE_NUM_SECTORS + STORAGE_CHECKPOINT_SECTORS]; /// Erases of every log sector, then of every checkpoint sector
+} storage_stats_t;
+
+/**
+ * @brief Told that the data of storage_flush_async is durable, called from the I/O context.
+ *        It must not call back into storage.
+ * 
+ * @param status 0 on success, -1 if a page program failed.
+ * @param pCtx Context given to storage_flush_async.
+ */
+typedef void (*storage_flush_cb_t)(int8_t status, void* pCtx);
+
+/**
+ * @brief Asks the owner of the payloads whether a record is still needed.
+ * 
+ * @param entryAddr Flash address of the record.
+ * @param pPayload Payload of the record.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pCtx Context given to storage_set_gc_callbacks.
+ * 
+ * @return 1 if the record must be kept, 0 if it can be dropped.
+ */
+typedef uint8_t (*storage_gc_is_live_cb_t)(uint32_t entryAddr, const void* pPayload, uint32_t payloadLen, void* pCtx);
+
+/**
+ * @brief Tells the owner of the payloads that a live record was copied to a new address.
+ * 
+ * @param oldAddr Flash address the record had.
+ * @param newAddr Flash address of the copy.
+ * @param pPayload Payload of the record.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pCtx Context given to storage_set_gc_callbacks.
+ */
+typedef void (*storage_gc_relocated_cb_t)(uint32_t oldAddr, uint32_t newAddr, const void* pPayload, uint32_t payloadLen, void* pCtx);
+
+/**
+ * @brief Lets the owner of the payloads change a live payload before the garbage collector copies it.
+ * 
+ * @param pPayload Payload of the record.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pNewPayload Buffer of MAX_STORAGE_ENTRY_PAYLOAD_LEN bytes receiving the payload to be copied.
+ * @param pCtx Context given to storage_set_gc_callbacks.
+ * 
+ * @return The length of pNewPayload, 0 to copy the payload unchanged.
+ */
+typedef uint32_t (*storage_gc_rewrite_cb_t)(const void* pPayload, uint32_t payloadLen, void* pNewPayload, void* pCtx);
+
+//////////////////////////////////////////////////////////////////////
+//                      Public Functions declaration
+//////////////////////////////////////////////////////////////////////
+
 /**
  * @name storage_init
  * @brief Initializes the storage module.
@@ -62,36 +192,163 @@ int8_t storage_deInit();
  * @name storage_store_entry
  * @brief Stores a payload entry into non-volatile memory.
  * 
+ * @details May run the garbage collector when the head sector is full.
+ * 
  * @param[in] pPayload Pointer to the payload data to be stored.
  * @param[in] payloadLen Length of the payload data in bytes.
+ * @param[out] pEntryAddr Set to the flash address of the new entry, may be NULL.
+ * 
+ * @retval 0 on success, -1 on failure (e.g., payload too large or storage full of live entries).
+ */
+int8_t storage_store_entry(const void* pPayload, uint32_t payloadLen, uint32_t* pEntryAddr);
+
+/**
+ * @name storage_store_entries
+ * @brief Buffers several entries to be written to non-volatile memory.
+ * 
+ * @details Records are built in the sector buffer one after the other, the next
+ *          storage_flush programs them with as few page programs as possible.
+ * 
+ * @param[in] pPayloads Payloads to be stored, in order.
+ * @param[in] numPayloads Number of payloads.
+ * @param[out] pEntryAddrs Set to the flash address of every new entry, may be NULL.
  * 
- * @retval 0 on success, -1 on failure (e.g., payload too large).
+ * @retval 0 on success, -1 on failure (nothing is stored when a payload is too large).
  */
-int8_t storage_store_entry(const void* pPayload, uint32_t payloadLen);
+int8_t storage_store_entries(const storage_payload_t* pPayloads, uint32_t numPayloads, uint32_t* pEntryAddrs);
+
+/**
+ * @name storage_set_gc_callbacks
+ * @brief Registers the callbacks the garbage collector uses to tell live records from superseded ones.
+ * 
+ * @details Without callbacks every record is considered live.
+ * 
+ * @param[in] isLive Called for every record of the sector being collected.
+ * @param[in] relocated Called after a live record was copied, may be NULL.
+ * @param[in] rewrite Called before a live record is copied, may be NULL.
+ * @param[in] pCtx Passed back to the callbacks.
+ */
+void storage_set_gc_callbacks(storage_gc_is_live_cb_t isLive, storage_gc_relocated_cb_t relocated, storage_gc_rewrite_cb_t rewrite, void* pCtx);
 
 /**
  * @name storage_flush
  * @brief Flushes any pending buffered data to non-volatile memory.
  * 
+ * @details Only the bytes appended since the last flush are programmed, page by page.
+ *          Sectors are erased when the log recycles them, never by a flush.
+ * 
  * @retval 0 on success, -1 on failure.
  */
 int8_t storage_flush();
 
+/**
+ * @name storage_flush_async
+ * @brief Starts programming the buffered data and returns without waiting for flash.
+ * 
+ * @details pDoneCb is called once the data is durable. It is called right away when nothing is
+ *          buffered. One flush is in flight at a time, a second call waits for the first one.
+ *          storage_flush and any other access to flash wait for the flush in flight.
+ * 
+ * @param[in] pDoneCb Called when the data is durable, may be NULL.
+ * @param[in] pCtx Handed to pDoneCb.
+ * 
+ * @retval 0 if the flush was started, -1 on failure (pDoneCb is not called).
+ */
+int8_t storage_flush_async(storage_flush_cb_t pDoneCb, void* pCtx);
+
+/**
+ * @name storage_get_stats
+ * @brief Copies the I/O and wear counters accumulated since the last reset.
+ * 
+ * @param[out] pStats Receives the counters.
+ */
+void storage_get_stats(storage_stats_t* pStats);
+
+/**
+ * @name storage_reset_stats
+ * @brief Sets every counter returned by storage_get_stats back to zero.
+ */
+void storage_reset_stats();
+
 /**
  * @name storage_retrieve_entry_payload
- * @brief Retrieves a payload entry from non-volatile memory by its index.
+ * @brief Retrieves a payload entry from non-volatile memory by its address.
+ * 
+ * @details Records have a variable length, so entries are addressed by the flash
+ *          address returned by storage_iter_addr rather than by an index.
  * 
  * @param[out] pPayload Pointer to a buffer to store the retrieved payload.
- * @param[in]  payloadLen The expected length of the payload to retrieve.
- * @param[in]  entryNum The zero-based index of the entry to retrieve.
+ * @param[in]  payloadLen Size of pPayload, longer payloads are truncated.
+ * @param[in]  entryAddr The flash address of the entry to retrieve.
+ * 
+ * @retval Length of the stored payload on success, -1 if the entry is not found or corrupted.
+ */
+int32_t storage_retrieve_entry_payload(void* pPayload, uint32_t payloadLen, uint32_t entryAddr);
+
+/**
+ * @name storage_iter_init
+ * @brief Starts an iteration at the first entry of the tail sector.
+ * 
+ * @param[out] pIter Iterator to be initialized.
+ */
+void storage_iter_init(storage_iter_t* pIter);
+
+/**
+ * @name storage_iter_next
+ * @brief Returns the next valid entry of the log.
+ * 
+ * @details Flash is read STORAGE_ITER_WINDOW_SIZE bytes at a time, from the tail
+ *          sector to the head sector. A corrupted entry ends its sector. Entries
+ *          stored but not flushed yet are returned as well.
+ * 
+ * @param[in,out] pIter Iterator initialized by storage_iter_init.
+ * @param[out] ppPayload Set to the payload of the entry, valid until the next call.
+ * @param[out] pPayloadLen Set to the length of the payload in bytes.
+ * 
+ * @retval 0 if an entry was returned, -1 at the end of the log.
+ */
+int8_t storage_iter_next(storage_iter_t* pIter, const void** ppPayload, uint32_t* pPayloadLen);
+
+/**
+ * @name storage_iter_addr
+ * @brief Address of the entry returned last by storage_iter_next.
+ * 
+ * @param[in] pIter Iterator.
+ * 
+ * @return The flash address of the entry, to be used with storage_retrieve_entry_payload.
+ */
+uint32_t storage_iter_addr(const storage_iter_t* pIter);
+
+/**
+ * @name storage_checkpoint_write
+ * @brief Flushes the log and stores a checkpoint taken at the current end of the log.
+ * 
+ * @param[in] pData Data of the checkpoint, only meaningful to the caller.
+ * @param[in] dataLen Length of the data in bytes, at most STORAGE_CHECKPOINT_MAX_LEN.
+ * 
+ * @retval 0 on success (nothing is written while the log is empty), -1 on failure.
+ */
+int8_t storage_checkpoint_write(const void* pData, uint32_t dataLen);
+
+/**
+ * @name storage_checkpoint_load
+ * @brief Reads the latest checkpoint and starts an iteration right after it.
+ * 
+ * @details The checkpoint is only returned while the log position it was taken at
+ *          is still part of the log, once the garbage collector retired it the
+ *          whole log has to be read again.
+ * 
+ * @param[out] pData Buffer receiving the data of the checkpoint.
+ * @param[in] dataLen Size of the buffer in bytes.
+ * @param[out] pIter Iterator set to the first entry stored after the checkpoint.
  * 
- * @retval 0 on success, -1 if the entry is not found or corrupted.
+ * @return The length of the data in bytes, -1 if there is no usable checkpoint.
  */
-int8_t storage_retrieve_entry_payload(void* pPayload, uint32_t payloadLen, uint16_t entryNum);
+int32_t storage_checkpoint_load(void* pData, uint32_t dataLen, storage_iter_t* pIter);
 
 /**
  * @name _reset_storage_state
- * @brief Resets the internal state of the storage module. (for testing only)
+ * @brief Resets the internal state of the storage module, locating the log again. (for testing only)
  */
 void _reset_storage_state();
 
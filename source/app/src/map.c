@@ -9,277 +9,2412 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef MAP_THREAD_SAFE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#endif
+
 //////////////////////////////////////////////////////////////////////
 //                             Macros
 //////////////////////////////////////////////////////////////////////
 
-#define MAP_TYPE_STR 0 /// Indicates the entry is of type string
-#define MAP_TYPE_U32 1 /// Indicates the entry is of type uint32_t
+#define MAP_TYPE_STR 0 /// Indicates the entry is of type string
+#define MAP_TYPE_U32 1 /// Indicates the entry is of type uint32_t
+#define MAP_TYPE_TX_COMMIT 2 /// Commit record of a transaction, carries no entry
+#define MAP_TYPE_DELETED 3 /// Tombstone of a deleted key, carries no value
+
+#define MAP_RECORD_COMPACT 0x80											/// Set in the first payload byte of compact entries, the low bits hold the type.
+#define MAP_RECORD_TX 0x40												/// Set in the first payload byte of records written inside a transaction, followed by the transaction id (uint16_t LE).
+#define MAP_RECORD_TYPE_MASK 0x3F										/// Mask extracting the type from the first payload byte of a compact entry.
+#define MAP_RECORD_MAX_LEN (4 + MAP_MAX_KEY_LEN + MAP_MAX_VAL_LEN_STR)	/// Longest compact entry: tag, transaction id, key length, key and value.
+
+#define MAP_INDEX_SIZE 256								/// Number of slots in the key index, power of two and larger than the number of distinct keys.
+#define MAP_INDEX_MASK (MAP_INDEX_SIZE - 1)				/// Mask used to wrap a hash or probe position into the key index.
+#define MAP_HASH_FNV_OFFSET_BASIS 0x811C9DC5U			/// FNV-1a 32 bit offset basis.
+#define MAP_HASH_FNV_PRIME 0x01000193U					/// FNV-1a 32 bit prime.
+#define MAP_INDEX_FREE 0xFF								/// Marks an unused slot of the key index, key numbers are below MAP_MAX_KEYS.
+
+#define MAP_CHECKPOINT_INTERVAL 64						/// Entries stored before map_store_all writes a new checkpoint.
+#define MAP_TX_MAX_ENTRIES 64							/// Maximum number of keys written inside one transaction.
+#define MAP_CHECKPOINT_TX_TAG 0x54580000				/// Marks the first word of a checkpoint as the next transaction id.
+
+#define MAP_ASYNC_RING_SIZE 64							/// Entries queued for the flusher thread, power of two.
+#define MAP_ASYNC_RING_MASK (MAP_ASYNC_RING_SIZE - 1)	/// Mask wrapping a ring position into a cell.
+#define MAP_ASYNC_IDLE_WAIT_NS 1000000					/// How long the flusher thread sleeps when the ring is empty.
+
+#ifndef MAP_CACHE_BYTES
+#define MAP_CACHE_BYTES 2048							/// RAM budget of the value cache used with MAP_LAZY_VALUES, 0 disables it.
+#endif
+#define MAP_CACHE_FREE_ADDR 0xFFFFFFFFU					/// Flash address of an empty cache line, no entry is stored there.
+#define MAP_CACHE_LINE_SIZE (sizeof(uint32_t) + sizeof(uint8_t) + sizeof(map_entry_t))	/// Bytes taken by one cached entry, address and reference bit included.
+#define MAP_CACHE_LINES ((MAP_CACHE_BYTES / MAP_CACHE_LINE_SIZE < MAP_MAX_KEYS) ? MAP_CACHE_BYTES / MAP_CACHE_LINE_SIZE : MAP_MAX_KEYS) /// Only the latest entry of a key is ever read
+
+_Static_assert(MAP_MAX_KEYS < MAP_INDEX_FREE && MAP_MAX_KEYS < MAP_INDEX_SIZE, "Key numbers must fit a key index slot");
+
+/**
+ * Define MAP_POOL_STATIC to place the arrays holding the keys in static memory.
+ * Otherwise they are allocated once by map_init and released by map_deInit.
+ */
+
+/**
+ * Define MAP_LAZY_VALUES to keep only the hash and the flash address of every key in RAM.
+ * Values are read back from flash on lookup, the arrays hold no key or value.
+ * Lookups then go through storage, which is not shared across threads.
+ */
+#if defined(MAP_LAZY_VALUES) && defined(MAP_THREAD_SAFE)
+#error "MAP_LAZY_VALUES reads flash on lookups, it cannot be combined with MAP_THREAD_SAFE"
+#endif
+
+/**
+ * With MAP_LAZY_VALUES, entries read from flash are kept in a CLOCK cache of MAP_CACHE_BYTES,
+ * keyed by flash address. Storing a new value of a cached key moves its line to the new address.
+ */
+#if defined(MAP_LAZY_VALUES) && MAP_CACHE_BYTES > 0
+#define MAP_VALUE_CACHE
+_Static_assert(MAP_CACHE_LINES > 0, "MAP_CACHE_BYTES must hold at least one entry");
+#endif
+
+/**
+ * Define MAP_THREAD_SAFE to guard the arrays holding the keys and the key index with a reader-writer lock.
+ * Readers only take it shared, writers take it exclusively just around in-memory updates,
+ * never while storing or flushing, so lookups do not wait for flash.
+ */
+#ifdef MAP_THREAD_SAFE
+#define MAP_INDEX_READ_LOCK() pthread_rwlock_rdlock(&indexLock)
+#define MAP_INDEX_WRITE_LOCK() pthread_rwlock_wrlock(&indexLock)
+#define MAP_INDEX_UNLOCK() pthread_rwlock_unlock(&indexLock)
+#else
+#define MAP_INDEX_READ_LOCK()
+#define MAP_INDEX_WRITE_LOCK()
+#define MAP_INDEX_UNLOCK()
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Global Variables
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Keys of the map as contiguous arrays, indexed by key number in order of first appearance.
+ */
+typedef struct map_columns
+{
+	uint32_t hash[MAP_MAX_KEYS];		 /// Hash of the key
+	uint32_t flashAddr[MAP_MAX_KEYS];	 /// Address in storage of the latest entry of the key
+#ifndef MAP_LAZY_VALUES
+	uint8_t	 type[MAP_MAX_KEYS];		 /// MAP_TYPE_STR or MAP_TYPE_U32
+	uint32_t valueU32[MAP_MAX_KEYS];	 /// Value of MAP_TYPE_U32 keys
+	char	 key[MAP_MAX_KEYS][MAP_MAX_KEY_LEN];
+	char	 valueStr[MAP_MAX_KEYS][MAP_MAX_VAL_LEN_STR];
+#endif
+} map_columns_t;
+
+static uint16_t			itemsInMap	= 0;				/// Number of keys held by the map
+static map_entry_log_t* pIndexedLog = NULL;				/// Handle given to map_read_log, the only one the arrays belong to
+static uint8_t			keyIndex[MAP_INDEX_SIZE];		/// Open addressing index, each used slot holds a key number, MAP_INDEX_FREE otherwise
+
+static uint16_t			entriesSinceCheckpoint = 0;		/// Entries stored or replayed since the last checkpoint
+static uint32_t			checkpointAddrs[1 + MAP_MAX_KEYS];	/// Next transaction id, then the flash address of the latest entry of every key in list order
+static uint8_t			txOpen		 = 0;				/// Set between map_tx_begin and map_tx_commit or map_tx_abort
+static uint16_t			txId		 = 0;				/// Id of the open transaction, or of the next one
+static uint16_t			txNumEntries = 0;				/// Entries written by the open transaction
+static uint32_t			txAddrs[MAP_TX_MAX_ENTRIES];	/// Flash address of the latest entry of every key of the open transaction, or of the one being replayed
+static uint32_t			txKeyHash[MAP_TX_MAX_ENTRIES];	/// Hash of the key stored at the matching txAddrs address
+
+static storage_iter_t logIter; /// Iterator used by map_read_log, kept off the stack
+
+#ifdef MAP_THREAD_SAFE
+static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER; /// Guards the arrays holding the keys and the key index
+
+/**
+ * @brief Cell of the bounded MPSC ring feeding the flusher thread.
+ *        seq equals the ring position when free and the position + 1 once filled.
+ */
+typedef struct map_async_cell
+{
+	atomic_size_t seq;
+	uint8_t		  payloadLen;
+	uint8_t		  payload[MAP_RECORD_MAX_LEN];
+} map_async_cell_t;
+
+static map_async_cell_t asyncRing[MAP_ASYNC_RING_SIZE];					 /// Encoded entries waiting for the flusher thread
+static atomic_size_t	asyncEnqueuePos = 0;								 /// Next ring position claimed by a producer
+static size_t			asyncDequeuePos = 0;								 /// Next ring position drained by the flusher thread
+static size_t			asyncDurablePos = 0;								 /// Ring positions below this one are stored and flushed
+static atomic_int		asyncRunning	= 0;								 /// Set while the flusher thread owns the writes
+static atomic_int		asyncStop		= 0;								 /// Asks the flusher thread to drain the ring and exit
+static int8_t			asyncError		= 0;								 /// Set when the flusher thread failed to store an entry
+static pthread_t		asyncThread;										 /// Flusher thread
+static pthread_mutex_t	asyncLock		= PTHREAD_MUTEX_INITIALIZER;		 /// Guards asyncDurablePos and asyncError
+static pthread_cond_t	asyncDurableCond = PTHREAD_COND_INITIALIZER;		 /// Signalled when asyncDurablePos moves
+static pthread_cond_t	asyncWakeCond	= PTHREAD_COND_INITIALIZER;			 /// Wakes the flusher thread up before its idle wait ends
+#endif
+
+#ifdef MAP_VALUE_CACHE
+static uint32_t			 cacheAddr[MAP_CACHE_LINES];	/// Flash address of the entry held by each cache line, MAP_CACHE_FREE_ADDR when empty
+static uint8_t			 cacheRef[MAP_CACHE_LINES];		/// CLOCK reference bit of each cache line, set on every hit
+static map_entry_t		 cacheEntry[MAP_CACHE_LINES];	/// Entry held by each cache line
+static uint16_t			 cacheHand = 0;					/// Next cache line looked at for eviction
+#endif
+static map_cache_stats_t cacheStats;					/// Counters reported by map_get_cache_stats
+
+#ifdef MAP_POOL_STATIC
+static map_columns_t  columns;			   /// Backing memory of the arrays holding the keys
+static map_columns_t* pColumns = &columns; /// Arrays holding the keys
+#else
+static map_columns_t* pColumns = NULL; /// Arrays holding the keys
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Functions declaration
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @name map_key_hash
+ * @brief Calculates the FNV-1a hash of a key string.
+ * 
+ * @param pKey Key string, at most MAP_MAX_KEY_LEN characters are hashed.
+ * 
+ * @return The 32-bit hash of the key.
+ */
+static uint32_t map_key_hash(const char* pKey);
+
+/**
+ * @name map_entry_encode
+ * @brief Encodes an entry in the compact payload format stored in flash.
+ * 
+ * @details | Type | TX | COMPACT (1) | [Transaction id (2)] | Key length (1) | Key | Value (uint32_t LE, or string bytes up to the end) |
+ *          Tombstones of deleted keys carry no value.
+ * 
+ * @param pEntry Entry to be encoded.
+ * @param pTxId Transaction the entry is written in, NULL outside transactions.
+ * @param pPayload Output buffer, at least MAP_RECORD_MAX_LEN bytes.
+ * 
+ * @return Length of the encoded payload in bytes.
+ */
+static uint32_t map_entry_encode(const map_entry_t* pEntry, const uint16_t* pTxId, uint8_t* pPayload);
+
+/**
+ * @name map_record_tx
+ * @brief Tells whether a payload was written inside a transaction.
+ * 
+ * @param pPayload Payload read from storage.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pTxId Set to the transaction id of the payload.
+ * 
+ * @retval 0 outside transactions, 1 for an entry of a transaction, 2 for a commit record.
+ */
+static uint8_t map_record_tx(const void* pPayload, uint32_t payloadLen, uint16_t* pTxId);
+
+/**
+ * @name map_entry_decode
+ * @brief Decodes a payload read from flash, compact or legacy packed map_entry_t.
+ * 
+ * @param pPayload Payload read from storage.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pEntry Decoded entry.
+ * 
+ * @retval 0 on success, -1 if the payload is not a valid entry.
+ */
+static int8_t map_entry_decode(const void* pPayload, uint32_t payloadLen, map_entry_t* pEntry);
+
+/**
+ * @name map_entry_from_kv
+ * @brief Fills an entry from a key-value pair, checking the lengths of key and value.
+ * 
+ * @param pKv Key-value pair.
+ * @param pEntry Entry to be filled.
+ * 
+ * @retval 0 on success, -1 if the key or value is too long.
+ */
+static int8_t map_entry_from_kv(const map_kv_t* pKv, map_entry_t* pEntry);
+
+/**
+ * @name map_entry_stored
+ * @brief Keeps the in-memory log up to date with an entry just stored.
+ * 
+ * @details Entries of the open transaction are only remembered, they are appended by map_tx_commit.
+ * 
+ * @param pEntry Entry stored.
+ * @param flashAddr Address in storage of the entry.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_entry_stored(const map_entry_t* pEntry, uint32_t flashAddr);
+
+/**
+ * @name map_tx_find
+ * @brief Looks for the slot of a key in txAddrs.
+ * 
+ * @param pKey Key to look for.
+ * @param hash Hash of the key.
+ * 
+ * @return Slot of the key, -1 if the transaction has no entry for it.
+ */
+static int32_t map_tx_find(const char* pKey, uint32_t hash);
+
+/**
+ * @name map_tx_track
+ * @brief Records the address of an entry of the transaction, replacing an earlier entry of the same key.
+ * 
+ * @param pKey Key of the entry.
+ * @param flashAddr Address in storage of the entry.
+ * 
+ * @retval 0 on success, -1 if the transaction already holds MAP_TX_MAX_ENTRIES keys.
+ */
+static int8_t map_tx_track(const char* pKey, uint32_t flashAddr);
+
+/**
+ * @name map_tx_apply
+ * @brief Appends the entries listed in txAddrs to the in-memory log.
+ * 
+ * @param numEntries Number of addresses in txAddrs.
+ * 
+ * @retval 0 on success, -1 if an entry could not be read.
+ */
+static int8_t map_tx_apply(uint16_t numEntries);
+
+/**
+ * @name map_store
+ * @brief Encodes an entry, stores it and appends it to the in-memory log.
+ * 
+ * @param pEntry Entry to be stored.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_store(const map_entry_t* pEntry);
+
+/**
+ * @name map_store_pending
+ * @brief Flushes the buffered entries, writing a checkpoint every MAP_CHECKPOINT_INTERVAL entries.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_store_pending();
+
+#ifdef MAP_THREAD_SAFE
+/**
+ * @name map_async_enqueue
+ * @brief Encodes an entry into the ring of the flusher thread, never blocks.
+ * 
+ * @param pEntry Entry to be queued.
+ * 
+ * @retval 0 on success, -1 if the ring is full.
+ */
+static int8_t map_async_enqueue(const map_entry_t* pEntry);
+
+/**
+ * @name map_async_drain
+ * @brief Stores every entry queued in the ring and flushes them together.
+ * 
+ * @return Number of entries drained.
+ */
+static uint32_t map_async_drain();
+
+/**
+ * @name map_async_flusher
+ * @brief Body of the flusher thread.
+ * 
+ * @param pArg Unused.
+ * 
+ * @return NULL.
+ */
+static void* map_async_flusher(void* pArg);
+#endif
+
+/**
+ * @name map_entry_print
+ * @brief Prints an entry to the console.
+ * 
+ * @param pView Entry to be printed.
+ */
+static void map_entry_print(const map_entry_view_t* pView);
+
+/**
+ * @name map_key_entry
+ * @brief Copies the latest entry of a key out of the arrays, reading it from flash with MAP_LAZY_VALUES.
+ * 
+ * @param keyNum Number of the key, below itemsInMap.
+ * @param pEntry Receives the entry.
+ * 
+ * @retval 0 on success, -1 if the entry could not be read.
+ */
+static int8_t map_key_entry(uint16_t keyNum, map_entry_t* pEntry);
+
+#ifdef MAP_LAZY_VALUES
+/**
+ * @name map_key_entry_ref
+ * @brief Finds the latest entry of a key in the value cache, or reads it from flash into a buffer.
+ * 
+ * @param keyNum Number of the key, below itemsInMap.
+ * @param pBuf Receives the entry when it is not cached.
+ * 
+ * @return The cached entry or pBuf, NULL if the entry could not be read.
+ */
+static const map_entry_t* map_key_entry_ref(uint16_t keyNum, map_entry_t* pBuf);
+#endif
+
+/**
+ * @name map_key_set
+ * @brief Copies an entry into the arrays, at the position of its key.
+ * 
+ * @param keyNum Number of the key.
+ * @param pEntry Latest entry of the key, only its address is kept with MAP_LAZY_VALUES.
+ * @param flashAddr Address in storage of the entry.
+ */
+static void map_key_set(uint16_t keyNum, const map_entry_t* pEntry, uint32_t flashAddr);
+
+#ifdef MAP_VALUE_CACHE
+/**
+ * @name map_cache_find
+ * @brief Looks for the cache line holding an entry.
+ * 
+ * @param flashAddr Address in storage of the entry.
+ * 
+ * @return The cache line, -1 if the entry is not cached.
+ */
+static int32_t map_cache_find(uint32_t flashAddr);
+
+/**
+ * @name map_cache_insert
+ * @brief Caches an entry read from flash, evicting the first line the CLOCK hand finds unreferenced.
+ * 
+ * @param flashAddr Address in storage of the entry.
+ * @param pEntry Entry to be cached.
+ */
+static void map_cache_insert(uint32_t flashAddr, const map_entry_t* pEntry);
+
+/**
+ * @name map_cache_move
+ * @brief Moves the line of a cached entry to another flash address.
+ * 
+ * @param oldAddr Address in storage the entry had.
+ * @param newAddr Address in storage of the entry now.
+ * @param pEntry New value of the entry, NULL if only its address changed.
+ */
+static void map_cache_move(uint32_t oldAddr, uint32_t newAddr, const map_entry_t* pEntry);
+
+/**
+ * @name map_cache_clear
+ * @brief Empties every cache line.
+ */
+static void map_cache_clear();
+#endif
+
+/**
+ * @name map_index_find_slot
+ * @brief Probes the key index for a key.
+ * 
+ * @param pKey Key string to look for.
+ * @param hash Hash of pKey, as returned by map_key_hash.
+ * @param pEntry Receives the latest entry of the key when it is found, may be NULL.
+ * 
+ * @return The slot holding the key, or the first free slot of its probe sequence.
+ *         -1 if the key is not present and the index is full.
+ */
+static int32_t map_index_find_slot(const char* pKey, uint32_t hash, map_entry_t* pEntry);
+
+/**
+ * @name map_index_find_addr
+ * @brief Probes the key index for the key pointing at an entry, without reading keys.
+ * 
+ * @param hash Hash of the key of the entry.
+ * @param flashAddr Address in storage of the entry.
+ * 
+ * @return The number of the key pointing at the entry, -1 if no key points at it.
+ */
+static int32_t map_index_find_addr(uint32_t hash, uint32_t flashAddr);
+
+/**
+ * @name map_index_remove
+ * @brief Frees a slot of the key index, shifting back the keys probed past it.
+ * 
+ * @param slot Used slot of the key index.
+ */
+static void map_index_remove(uint32_t slot);
+
+/**
+ * @name map_columns_init
+ * @brief Makes the arrays holding the keys available, allocating them if needed.
+ * 
+ * @retval 0 on success, -1 if the arrays could not be allocated.
+ */
+static int8_t map_columns_init();
+
+/**
+ * @name map_columns_deInit
+ * @brief Returns the memory of the arrays holding the keys.
+ */
+static void map_columns_deInit();
+
+/**
+ * @name map_log_append
+ * @brief Updates the entry of a known key, or appends a new key to the arrays and indexes it.
+ * 
+ * @param pEntry Entry to be appended.
+ * @param flashAddr Address in storage of the entry.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_log_append(const map_entry_t* pEntry, uint32_t flashAddr);
+
+/**
+ * @name map_key_known
+ * @brief Tells whether a key is held by the arrays.
+ * 
+ * @details Reads the key index without locking it, only its writer calls it without MAP_INDEX_READ_LOCK.
+ * 
+ * @param pKey Key to look for.
+ * 
+ * @retval 1 if the key is known, 0 otherwise.
+ */
+static uint8_t map_key_known(const char* pKey);
+
+/**
+ * @name map_key_room
+ * @brief Tells whether the arrays have room for the key of an entry about to be stored.
+ * 
+ * @details The key index is only probed once the arrays may be full, same locking as map_key_known.
+ * 
+ * @param pKey Key of the entry.
+ * @param numReserved Keys that entries stored but not appended yet may add.
+ * 
+ * @retval 0 if the key fits, -1 if it is new and the arrays are full.
+ */
+static int8_t map_key_room(const char* pKey, uint16_t numReserved);
+
+/**
+ * @name map_log_remove
+ * @brief Drops the key held by a slot from the arrays and the key index.
+ * 
+ * @param slot Used slot of the key index.
+ */
+static void map_log_remove(uint32_t slot);
+
+/**
+ * @name map_log_rebuild
+ * @brief Rebuilds the arrays from the latest checkpoint and the entries stored after it.
+ * 
+ * @param pMapLog Handle of the map.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_log_rebuild(map_entry_log_t* pMapLog);
+
+/**
+ * @name map_log_release
+ * @brief Drops every key and clears the key index.
+ * 
+ * @param pMapLog Handle of the map.
+ */
+static void map_log_release(map_entry_log_t* pMapLog);
+
+/**
+ * @name map_checkpoint
+ * @brief Stores a checkpoint with the flash address of the latest entry of every key.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t map_checkpoint();
+
+/**
+ * @name map_log_load_checkpoint
+ * @brief Rebuilds the arrays from the entries listed by a checkpoint.
+ * 
+ * @param checkpointLen Length of the checkpoint loaded in checkpointAddrs, in bytes.
+ * 
+ * @retval 0 on success, -1 if an entry could not be read.
+ */
+static int8_t map_log_load_checkpoint(uint32_t checkpointLen);
+
+/**
+ * @name map_gc_is_live
+ * @brief Storage garbage collector callback, an entry is live while its key points at it.
+ * 
+ * @param entryAddr Address in storage of the entry.
+ * @param pPayload Payload of the entry.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pCtx Unused.
+ * 
+ * @return 1 if the entry holds the latest value of its key, 0 otherwise.
+ */
+static uint8_t map_gc_is_live(uint32_t entryAddr, const void* pPayload, uint32_t payloadLen, void* pCtx);
+
+/**
+ * @name map_gc_relocated
+ * @brief Storage garbage collector callback, points the entry's key at the copy.
+ * 
+ * @param oldAddr Address in storage the entry had.
+ * @param newAddr Address in storage of the copy.
+ * @param pPayload Payload of the entry.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pCtx Unused.
+ */
+static void map_gc_relocated(uint32_t oldAddr, uint32_t newAddr, const void* pPayload, uint32_t payloadLen, void* pCtx);
+
+/**
+ * @name map_gc_rewrite
+ * @brief Storage garbage collector callback, drops the transaction tag of committed entries being copied.
+ * 
+ * @details The commit record of a transaction is not copied, its live entries become plain entries.
+ * 
+ * @param pPayload Payload of the entry.
+ * @param payloadLen Length of the payload in bytes.
+ * @param pNewPayload Receives the plain entry.
+ * @param pCtx Unused.
+ * 
+ * @return The length of the plain entry, 0 to copy the entry unchanged.
+ */
+static uint32_t map_gc_rewrite(const void* pPayload, uint32_t payloadLen, void* pNewPayload, void* pCtx);
+
+//////////////////////////////////////////////////////////////////////
+//                      Public Functions definition
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Initializes the map module.
+ */
+int8_t map_init(map_entry_log_t* pMapLog)
+{
+	if (-1 == map_columns_init())
+	{
+		return -1;
+	}
+
+	storage_set_gc_callbacks(map_gc_is_live, map_gc_relocated, map_gc_rewrite, NULL);
+
+	if (-1 == storage_init())
+	{
+		return -1;
+	}
+
+	if (-1 == map_read_log(pMapLog))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Flushes the buffered entries, writing a checkpoint every MAP_CHECKPOINT_INTERVAL entries.
+ */
+int8_t map_store_all()
+{
+#ifdef MAP_THREAD_SAFE
+	if (asyncRunning)
+	{
+		return map_sync();
+	}
+#endif
+
+	return map_store_pending();
+}
+
+/**
+ * @brief Starts flushing the buffered entries and returns without waiting for flash.
+ */
+int8_t map_store_all_async(map_flush_done_cb_t pDoneCb, void* pCtx)
+{
+#ifdef MAP_THREAD_SAFE
+	if (asyncRunning)
+	{
+		return -1;
+	}
+#endif
+
+	// A checkpoint due stays due, the next map_store_all writes it once the entries are in flash
+	return storage_flush_async(pDoneCb, pCtx);
+}
+
+/**
+ * @brief Starts the flusher thread, entries added from now on are queued for it.
+ */
+int8_t map_async_start()
+{
+#ifdef MAP_THREAD_SAFE
+	if (asyncRunning || txOpen)
+	{
+		return -1;
+	}
+
+	// The ring is empty, every cell is free for the next lap of positions
+	for (size_t pos = asyncDequeuePos; pos != asyncDequeuePos + MAP_ASYNC_RING_SIZE; pos++)
+	{
+		atomic_store(&asyncRing[pos & MAP_ASYNC_RING_MASK].seq, pos);
+	}
+
+	atomic_store(&asyncEnqueuePos, asyncDequeuePos);
+	asyncDurablePos = asyncDequeuePos;
+	asyncError		= 0;
+	atomic_store(&asyncStop, 0);
+
+	if (0 != pthread_create(&asyncThread, NULL, map_async_flusher, NULL))
+	{
+		return -1;
+	}
+
+	atomic_store(&asyncRunning, 1);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * @brief Stores whatever is still queued and stops the flusher thread.
+ */
+int8_t map_async_stop()
+{
+#ifdef MAP_THREAD_SAFE
+	if (!asyncRunning)
+	{
+		return -1;
+	}
+
+	atomic_store(&asyncStop, 1);
+
+	pthread_mutex_lock(&asyncLock);
+	pthread_cond_signal(&asyncWakeCond);
+	pthread_mutex_unlock(&asyncLock);
+
+	pthread_join(asyncThread, NULL);
+	atomic_store(&asyncRunning, 0);
+
+	return asyncError ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * @brief Waits until every entry added before the call is stored and flushed.
+ */
+int8_t map_sync()
+{
+#ifdef MAP_THREAD_SAFE
+	size_t target;
+	int8_t ret;
+
+	if (!asyncRunning)
+	{
+		return map_store_pending();
+	}
+
+	// Every position below target is claimed, the flusher drains them in order
+	target = atomic_load(&asyncEnqueuePos);
+
+	pthread_mutex_lock(&asyncLock);
+	pthread_cond_signal(&asyncWakeCond);
+
+	while ((ptrdiff_t)(asyncDurablePos - target) < 0 && !asyncError)
+	{
+		pthread_cond_wait(&asyncDurableCond, &asyncLock);
+	}
+
+	ret = asyncError ? -1 : 0;
+	pthread_mutex_unlock(&asyncLock);
+
+	return ret;
+#else
+	return map_store_pending();
+#endif
+}
+
+/**
+ * @brief Adds a new map entry with a string value.
+ */
+int8_t map_add_entry_val_str(const char* pKey, const char* pVal)
+{
+	map_entry_t entry;
+	map_kv_t	kv = {pKey, pVal, 0};
+
+	if (-1 == map_entry_from_kv(&kv, &entry))
+	{
+		return -1;
+	}
+
+	return map_store(&entry);
+}
+
+/**
+ * @brief Adds a new map entry with a uint32_t value.
+ */
+int8_t map_add_entry_val_u32(const char* pKey, uint32_t valueU32)
+{
+	map_entry_t entry;
+	map_kv_t	kv = {pKey, NULL, valueU32};
+
+	if (-1 == map_entry_from_kv(&kv, &entry))
+	{
+		return -1;
+	}
+
+	return map_store(&entry);
+}
+
+/**
+ * @brief Adds several map entries and commits them with a single flush.
+ */
+int8_t map_add_entries(const map_kv_t* pEntries, size_t numEntries)
+{
+	map_entry_t entry;
+	uint8_t		payload[MAP_RECORD_MAX_LEN];
+	uint32_t	payloadLen;
+	uint32_t	flashAddr;
+	size_t		prev;
+	size_t		numNewKeys = 0;
+
+	if (txOpen && txNumEntries + numEntries > MAP_TX_MAX_ENTRIES)
+	{
+		return -1;
+	}
+
+#ifdef MAP_THREAD_SAFE
+	// The flusher thread is the only writer while it runs
+	if (asyncRunning)
+	{
+		return -1;
+	}
+#endif
+
+	// Check every entry first, so a bad one does not leave the batch half stored
+	for (size_t i = 0; i < numEntries; i++)
+	{
+		if (-1 == map_entry_from_kv(&pEntries[i], &entry))
+		{
+			return -1;
+		}
+	}
+
+	// Same for the keys the batch adds, a full map must reject it before anything reaches flash.
+	// They are only counted once the batch may not fit, every key of an open transaction may be new.
+	for (size_t i = 0; pIndexedLog != NULL && itemsInMap + txNumEntries + numEntries > MAP_MAX_KEYS && i < numEntries; i++)
+	{
+		if (map_key_known(pEntries[i].pKey) || (txOpen && map_tx_find(pEntries[i].pKey, map_key_hash(pEntries[i].pKey)) >= 0))
+		{
+			continue;
+		}
+
+		// A key repeated in the batch is only added once
+		prev = 0;
+		while (prev < i && strncmp(pEntries[prev].pKey, pEntries[i].pKey, MAP_MAX_KEY_LEN) != 0)
+		{
+			prev++;
+		}
+
+		if (prev == i && itemsInMap + txNumEntries + ++numNewKeys > MAP_MAX_KEYS)
+		{
+			return -1;
+		}
+	}
+
+	// Each record is indexed before the next one is appended: opening a new sector may run the
+	// garbage collector, which must already see the older records of the batch keys as superseded.
+	for (size_t i = 0; i < numEntries; i++)
+	{
+		map_entry_from_kv(&pEntries[i], &entry);
+		payloadLen = map_entry_encode(&entry, txOpen ? &txId : NULL, payload);
+
+		if (-1 == storage_store_entry(payload, payloadLen, &flashAddr) || -1 == map_entry_stored(&entry, flashAddr))
+		{
+			return -1;
+		}
+	}
+
+	return storage_flush();
+}
+
+/**
+ * @brief Starts a transaction.
+ */
+int8_t map_tx_begin()
+{
+#ifdef MAP_THREAD_SAFE
+	if (asyncRunning)
+	{
+		return -1;
+	}
+#endif
+
+	if (txOpen)
+	{
+		return -1;
+	}
+
+	txOpen		 = 1;
+	txNumEntries = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Stores the commit marker of the open transaction and applies its entries.
+ */
+int8_t map_tx_commit()
+{
+	uint8_t	 commit[3];
+	uint32_t flashAddr;
+	int8_t	 ret = 0;
+
+	if (!txOpen)
+	{
+		return -1;
+	}
+
+	commit[0] = MAP_RECORD_COMPACT | MAP_RECORD_TX | MAP_TYPE_TX_COMMIT;
+	commit[1] = (uint8_t)txId;
+	commit[2] = (uint8_t)(txId >> 8);
+
+	// The entries only count once the marker is in flash
+	if (-1 == storage_store_entry(commit, sizeof(commit), &flashAddr) || -1 == storage_flush())
+	{
+		ret = -1;
+	}
+
+	txOpen = 0;
+
+	// Readers see either none or all of the entries
+	if (0 == ret && pIndexedLog != NULL)
+	{
+		MAP_INDEX_WRITE_LOCK();
+		ret = map_tx_apply(txNumEntries);
+		MAP_INDEX_UNLOCK();
+	}
+
+	txNumEntries = 0;
+	txId++;
+
+	return ret;
+}
+
+/**
+ * @brief Drops the entries added since map_tx_begin.
+ */
+int8_t map_tx_abort()
+{
+	if (!txOpen)
+	{
+		return -1;
+	}
+
+	// Without a commit marker the entries already stored are ignored by map_read_log
+	txOpen		 = 0;
+	txNumEntries = 0;
+	txId++;
+
+	return 0;
+}
+
+/**
+ * @brief De-initializes the map, freeing allocated memory.
+ */
+int8_t map_deInit(map_entry_log_t* pMapLog)
+{
+	int8_t ret = 0;
+
+#ifdef MAP_THREAD_SAFE
+	// Whatever is still queued goes to flash before the checkpoint
+	if (asyncRunning && -1 == map_async_stop())
+	{
+		ret = -1;
+	}
+#endif
+
+	// Entries of a transaction that was not committed are ignored on the next map_init
+	(void)map_tx_abort();
+
+	// The next map_init only has to read what was stored after this checkpoint
+	if (entriesSinceCheckpoint > 0 && -1 == map_checkpoint())
+	{
+		ret = -1;
+	}
+
+	MAP_INDEX_WRITE_LOCK();
+
+	map_log_release(pMapLog);
+	map_columns_deInit();
+
+	pIndexedLog = NULL;
+
+	MAP_INDEX_UNLOCK();
+
+	storage_set_gc_callbacks(NULL, NULL, NULL, NULL);
+
+	if (-1 == storage_deInit())
+	{
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Reads all entries from storage and populates the in-memory
+ *        arrays and key index.
+ * 
+ * \todo current implementation doesnt deal properly with memory corruption, 
+ * if an entry was corrupted, it stops reading the log and ignores next possible values
+ */
+int8_t map_read_log(map_entry_log_t* pMapLog)
+{
+	int8_t ret;
+
+#ifdef MAP_THREAD_SAFE
+	if (asyncRunning)
+	{
+		return -1;
+	}
+#endif
+
+	// Readers wait for the whole list, never see it half rebuilt
+	MAP_INDEX_WRITE_LOCK();
+	ret = map_log_rebuild(pMapLog);
+	MAP_INDEX_UNLOCK();
+
+	return ret;
+}
+
+/**
+ * @brief Prints the contents of the in-memory map log.
+ */
+void map_print_log(map_entry_log_t* pMapLog)
+{
+	map_iter_t				iter;
+	const map_entry_view_t* pView;
+
+	if (-1 == map_iter_begin(pMapLog, &iter))
+	{
+		return;
+	}
+
+	while ((pView = map_iter_next(&iter)) != NULL)
+	{
+		map_entry_print(pView);
+	}
+
+	map_iter_end(&iter);
+}
+
+/**
+ * @brief Starts walking the latest value of every key.
+ */
+int8_t map_iter_begin(map_entry_log_t* pMapLog, map_iter_t* pIter)
+{
+	if (pMapLog == NULL || pIter == NULL)
+	{
+		return -1;
+	}
+
+	MAP_INDEX_READ_LOCK();
+
+	// Only the map read by map_read_log holds the latest values
+	if (pMapLog != pIndexedLog)
+	{
+		MAP_INDEX_UNLOCK();
+		return -1;
+	}
+
+	pIter->numYielded = 0;
+	pIter->locked	  = 1;
+
+	return 0;
+}
+
+/**
+ * @brief Steps to the next key.
+ */
+const map_entry_view_t* map_iter_next(map_iter_t* pIter)
+{
+	uint16_t keyNum;
+#ifdef MAP_LAZY_VALUES
+	const map_entry_t* pEntry;
+#endif
+
+	// Keys whose entry cannot be read back from flash are skipped
+	while (pIter->numYielded < itemsInMap)
+	{
+		keyNum = pIter->numYielded++;
+
+#ifdef MAP_LAZY_VALUES
+		pEntry = map_key_entry_ref(keyNum, &pIter->entry);
+		if (pEntry == NULL)
+		{
+			continue;
+		}
+
+		pIter->view.key		 = pEntry->key;
+		pIter->view.valueStr = pEntry->valueStr;
+		pIter->view.type	 = pEntry->type;
+		pIter->view.valueU32 = pEntry->valueU32;
+#else
+		pIter->view.key		 = pColumns->key[keyNum];
+		pIter->view.valueStr = pColumns->valueStr[keyNum];
+		pIter->view.type	 = pColumns->type[keyNum];
+		pIter->view.valueU32 = pColumns->valueU32[keyNum];
+#endif
+
+		return &pIter->view;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Ends a walk started by map_iter_begin.
+ */
+void map_iter_end(map_iter_t* pIter)
+{
+	if (pIter != NULL && pIter->locked)
+	{
+		pIter->locked = 0;
+		MAP_INDEX_UNLOCK();
+	}
+}
+
+/**
+ * @brief Retrieves a map entry by its sequential number in the log.
+ */
+int8_t map_get_entry_via_num(map_entry_log_t* pMapLog, uint16_t entryNum, map_entry_t* pEntry)
+{
+	int8_t ret = -1;
+
+	if (pMapLog == NULL || pEntry == NULL)
+	{
+		return -1;
+	}
+
+	MAP_INDEX_READ_LOCK();
+
+	// Keys are numbered in order of first appearance
+	if (pMapLog == pIndexedLog && entryNum < itemsInMap)
+	{
+		ret = map_key_entry(entryNum, pEntry);
+	}
+
+	MAP_INDEX_UNLOCK();
+
+	return ret;
+}
+
+/**
+ * @brief Retrieves the latest map entry of a key through the key index.
+ */
+int8_t map_get_entry_via_key(map_entry_log_t* pMapLog, const char* key, map_entry_t* pEntry)
+{
+	int32_t slot = -1;
+
+	if (pMapLog == NULL || key == NULL || pEntry == NULL)
+	{
+		return -1;
+	}
+
+	MAP_INDEX_READ_LOCK();
+
+	// Only the list built by map_read_log is indexed
+	if (pMapLog == pIndexedLog && itemsInMap > 0)
+	{
+		slot = map_index_find_slot(key, map_key_hash(key), pEntry);
+	}
+
+	// The probe ends on a free slot when the key is not in the map
+	if (slot != -1 && keyIndex[slot] == MAP_INDEX_FREE)
+	{
+		slot = -1;
+	}
+
+	MAP_INDEX_UNLOCK();
+
+	return (slot != -1) ? 0 : -1;
+}
+
+/**
+ * @brief Copies the counters of the value cache.
+ */
+void map_get_cache_stats(map_cache_stats_t* pStats)
+{
+	if (pStats != NULL)
+	{
+		*pStats = cacheStats;
+	}
+}
+
+/**
+ * @brief Zeroes the counters of the value cache.
+ */
+void map_reset_cache_stats()
+{
+	memset(&cacheStats, 0, sizeof(cacheStats));
+}
+
+/**
+ * @brief Appends a tombstone for a key and drops it from the in-memory log.
+ */
+int8_t map_delete_entry(map_entry_log_t* pMapLog, const char* key)
+{
+	map_entry_t entry;
+	map_kv_t	kv	 = {key, NULL, 0};
+	int32_t		slot = -1;
+
+	if (pMapLog == NULL || pMapLog != pIndexedLog || -1 == map_entry_from_kv(&kv, &entry))
+	{
+		return -1;
+	}
+
+	entry.entryDeletedFlag = ENTRY_DELETED_VALUE;
+
+#ifdef MAP_THREAD_SAFE
+	// The key may still be queued for the flusher thread
+	if (asyncRunning)
+	{
+		return map_store(&entry);
+	}
+#endif
+
+	// Inside a transaction the key may only be added by the transaction itself
+	if (!txOpen)
+	{
+		MAP_INDEX_READ_LOCK();
+		slot = map_index_find_slot(key, map_key_hash(key), NULL);
+		if (slot != -1 && keyIndex[slot] == MAP_INDEX_FREE)
+		{
+			slot = -1;
+		}
+		MAP_INDEX_UNLOCK();
+
+		if (slot == -1)
+		{
+			return -1;
+		}
+	}
+
+	return map_store(&entry);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Functions definition
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Calculates the FNV-1a hash of a key string.
+ */
+static uint32_t map_key_hash(const char* pKey)
+{
+	uint32_t hash = MAP_HASH_FNV_OFFSET_BASIS;
+
+	for (uint8_t i = 0; i < MAP_MAX_KEY_LEN && pKey[i] != '\0'; i++)
+	{
+		hash ^= (uint8_t)pKey[i];
+		hash *= MAP_HASH_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/**
+ * @brief Encodes an entry in the compact payload format stored in flash.
+ */
+static uint32_t map_entry_encode(const map_entry_t* pEntry, const uint16_t* pTxId, uint8_t* pPayload)
+{
+	uint32_t keyLen = strnlen(pEntry->key, MAP_MAX_KEY_LEN - 1);
+	uint32_t valLen;
+	uint32_t len = 0;
+
+	pPayload[len++] = MAP_RECORD_COMPACT | ((pEntry->entryDeletedFlag == ENTRY_DELETED_VALUE) ? MAP_TYPE_DELETED : pEntry->type);
+
+	if (pTxId != NULL)
+	{
+		pPayload[0] |= MAP_RECORD_TX;
+		pPayload[len++] = (uint8_t)(*pTxId);
+		pPayload[len++] = (uint8_t)(*pTxId >> 8);
+	}
+
+	pPayload[len++] = (uint8_t)keyLen;
+	memcpy(&pPayload[len], pEntry->key, keyLen);
+	len += keyLen;
+
+	if (pEntry->entryDeletedFlag == ENTRY_DELETED_VALUE)
+	{
+		return len;
+	}
+
+	if (pEntry->type == MAP_TYPE_U32)
+	{
+		pPayload[len++] = (uint8_t)(pEntry->valueU32);
+		pPayload[len++] = (uint8_t)(pEntry->valueU32 >> 8);
+		pPayload[len++] = (uint8_t)(pEntry->valueU32 >> 16);
+		pPayload[len++] = (uint8_t)(pEntry->valueU32 >> 24);
+	}
+	else
+	{
+		valLen = strnlen(pEntry->valueStr, MAP_MAX_VAL_LEN_STR - 1);
+		memcpy(&pPayload[len], pEntry->valueStr, valLen);
+		len += valLen;
+	}
+
+	return len;
+}
+
+/**
+ * @brief Decodes a payload read from flash, compact or legacy packed map_entry_t.
+ */
+static int8_t map_entry_decode(const void* pPayload, uint32_t payloadLen, map_entry_t* pEntry)
+{
+	const uint8_t* pBytes = (const uint8_t*)pPayload;
+	uint32_t	   keyLen;
+	uint32_t	   valLen;
+
+	memset(pEntry, 0, sizeof(map_entry_t));
+
+	// Entries written before the compact format are a packed map_entry_t
+	if (payloadLen == sizeof(map_entry_t) && !(pBytes[0] & MAP_RECORD_COMPACT))
+	{
+		memcpy(pEntry, pPayload, sizeof(map_entry_t));
+		pEntry->key[MAP_MAX_KEY_LEN - 1]		   = '\0';
+		pEntry->valueStr[MAP_MAX_VAL_LEN_STR - 1] = '\0';
+
+		return 0;
+	}
+
+	if (payloadLen < 2 || !(pBytes[0] & MAP_RECORD_COMPACT))
+	{
+		return -1;
+	}
+
+	pEntry->type = pBytes[0] & MAP_RECORD_TYPE_MASK;
+
+	// The transaction id is only needed while reading the log
+	if (pBytes[0] & MAP_RECORD_TX)
+	{
+		if (pEntry->type == MAP_TYPE_TX_COMMIT || payloadLen < 4)
+		{
+			return -1;
+		}
+
+		pBytes += 2;
+		payloadLen -= 2;
+	}
+
+	keyLen = pBytes[1];
+
+	if (keyLen >= MAP_MAX_KEY_LEN || 2 + keyLen > payloadLen)
+	{
+		return -1;
+	}
+
+	memcpy(pEntry->key, &pBytes[2], keyLen);
+
+	pBytes += 2 + keyLen;
+	valLen = payloadLen - 2 - keyLen;
+
+	if (pEntry->type == MAP_TYPE_DELETED)
+	{
+		pEntry->entryDeletedFlag = ENTRY_DELETED_VALUE;
+
+		return (valLen == 0) ? 0 : -1;
+	}
+
+	if (pEntry->type == MAP_TYPE_U32)
+	{
+		if (valLen != sizeof(uint32_t))
+		{
+			return -1;
+		}
+
+		pEntry->valueU32 = (uint32_t)pBytes[0] | ((uint32_t)pBytes[1] << 8) | ((uint32_t)pBytes[2] << 16) | ((uint32_t)pBytes[3] << 24);
+	}
+	else
+	{
+		if (valLen >= MAP_MAX_VAL_LEN_STR)
+		{
+			return -1;
+		}
+
+		memcpy(pEntry->valueStr, pBytes, valLen);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Tells whether a payload was written inside a transaction.
+ */
+static uint8_t map_record_tx(const void* pPayload, uint32_t payloadLen, uint16_t* pTxId)
+{
+	const uint8_t* pBytes = (const uint8_t*)pPayload;
+	uint8_t		   tag	  = (payloadLen > 0) ? pBytes[0] : 0;
+
+	if ((tag & (MAP_RECORD_COMPACT | MAP_RECORD_TX)) != (MAP_RECORD_COMPACT | MAP_RECORD_TX) || payloadLen < 3)
+	{
+		return 0;
+	}
+
+	*pTxId = (uint16_t)(pBytes[1] | (pBytes[2] << 8));
+
+	return ((tag & MAP_RECORD_TYPE_MASK) == MAP_TYPE_TX_COMMIT) ? 2 : 1;
+}
+
+/**
+ * @brief Fills an entry from a key-value pair, checking the lengths of key and value.
+ */
+static int8_t map_entry_from_kv(const map_kv_t* pKv, map_entry_t* pEntry)
+{
+	if (pKv->pKey == NULL || strlen(pKv->pKey) > MAP_MAX_KEY_LEN)
+	{
+		return -1;
+	}
+
+	if (pKv->pValStr != NULL && strlen(pKv->pValStr) > MAP_MAX_VAL_LEN_STR)
+	{
+		return -1;
+	}
+
+	memset(pEntry, 0, sizeof(map_entry_t));
+
+	pEntry->entryDeletedFlag = ENTRY_NOT_DELETED_VALUE;
+	strncpy(pEntry->key, pKv->pKey, MAP_MAX_KEY_LEN - 1);
+
+	if (pKv->pValStr != NULL)
+	{
+		pEntry->type = MAP_TYPE_STR;
+		strncpy(pEntry->valueStr, pKv->pValStr, MAP_MAX_VAL_LEN_STR - 1);
+	}
+	else
+	{
+		pEntry->type	 = MAP_TYPE_U32;
+		pEntry->valueU32 = pKv->valueU32;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Encodes an entry, stores it and appends it to the in-memory log.
+ */
+static int8_t map_store(const map_entry_t* pEntry)
+{
+	uint8_t	 payload[MAP_RECORD_MAX_LEN];
+	uint32_t payloadLen;
+	uint32_t flashAddr;
+	int32_t	 txSlot	   = -1;
+	uint8_t	 tombstone = (pEntry->entryDeletedFlag == ENTRY_DELETED_VALUE);
+
+#ifdef MAP_THREAD_SAFE
+	int8_t keyRoom = 0;
+
+	if (asyncRunning)
+	{
+		// Keys still queued are not counted, the flusher thread checks again before storing
+		if (!tombstone)
+		{
+			MAP_INDEX_READ_LOCK();
+			keyRoom = map_key_room(pEntry->key, 0);
+			MAP_INDEX_UNLOCK();
+		}
+
+		return (keyRoom == -1) ? -1 : map_async_enqueue(pEntry);
+	}
+#endif
+
+	payloadLen = map_entry_encode(pEntry, txOpen ? &txId : NULL, payload);
+
+	if (txOpen)
+	{
+		txSlot = map_tx_find(pEntry->key, map_key_hash(pEntry->key));
+	}
+
+	if (txOpen && txNumEntries >= MAP_TX_MAX_ENTRIES && txSlot < 0)
+	{
+		return -1;
+	}
+
+	// A new key the map has no room for must not reach flash, map_read_log could not hold it either.
+	// Every key of the open transaction may be new, a key it already holds was checked when first stored.
+	if (!tombstone && txSlot < 0 && -1 == map_key_room(pEntry->key, txNumEntries))
+	{
+		return -1;
+	}
+
+	if (-1 == storage_store_entry(payload, payloadLen, &flashAddr))
+	{
+		return -1;
+	}
+
+	return map_entry_stored(pEntry, flashAddr);
+}
+
+/**
+ * @brief Flushes the buffered entries, writing a checkpoint every MAP_CHECKPOINT_INTERVAL entries.
+ */
+static int8_t map_store_pending()
+{
+	if (-1 == storage_flush())
+	{
+		return -1;
+	}
+
+	if (entriesSinceCheckpoint >= MAP_CHECKPOINT_INTERVAL)
+	{
+		return map_checkpoint();
+	}
+
+	return 0;
+}
+
+#ifdef MAP_THREAD_SAFE
+/**
+ * @brief Encodes an entry into the ring of the flusher thread, never blocks.
+ */
+static int8_t map_async_enqueue(const map_entry_t* pEntry)
+{
+	map_async_cell_t* pCell;
+	size_t			  pos = atomic_load_explicit(&asyncEnqueuePos, memory_order_relaxed);
+	size_t			  seq;
+
+	// Claim a free cell, producers racing for the same one retry with the next
+	for (;;)
+	{
+		pCell = &asyncRing[pos & MAP_ASYNC_RING_MASK];
+		seq	  = atomic_load_explicit(&pCell->seq, memory_order_acquire);
+
+		if (seq == pos)
+		{
+			if (atomic_compare_exchange_weak_explicit(&asyncEnqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if ((ptrdiff_t)(seq - pos) < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&asyncEnqueuePos, memory_order_relaxed);
+		}
+	}
+
+	pCell->payloadLen = (uint8_t)map_entry_encode(pEntry, NULL, pCell->payload);
+	atomic_store_explicit(&pCell->seq, pos + 1, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * @brief Stores every entry queued in the ring and flushes them together.
+ */
+static uint32_t map_async_drain()
+{
+	map_async_cell_t* pCell;
+	map_entry_t		  entry;
+	uint32_t		  flashAddr;
+	uint32_t		  numDrained = 0;
+	int8_t			  ret		 = 0;
+	uint8_t			  skip;
+
+	for (;;)
+	{
+		pCell = &asyncRing[asyncDequeuePos & MAP_ASYNC_RING_MASK];
+
+		if (atomic_load_explicit(&pCell->seq, memory_order_acquire) != asyncDequeuePos + 1)
+		{
+			break;
+		}
+
+		if (0 == ret && -1 == map_entry_decode(pCell->payload, pCell->payloadLen, &entry))
+		{
+			ret = -1;
+		}
+
+		// Producers checked the key before the entries queued ahead of it were applied, this thread is the only writer of the index
+		if (0 == ret && entry.entryDeletedFlag != ENTRY_DELETED_VALUE && -1 == map_key_room(entry.key, 0))
+		{
+			ret = -1;
+		}
+
+		// The tombstone of a key never stored is dropped, there is nothing to delete
+		skip = (0 == ret && entry.entryDeletedFlag == ENTRY_DELETED_VALUE && pIndexedLog != NULL && !map_key_known(entry.key));
+
+		if (0 == ret && !skip && -1 == storage_store_entry(pCell->payload, pCell->payloadLen, &flashAddr))
+		{
+			ret = -1;
+		}
+
+		if (0 == ret && !skip)
+		{
+			ret = map_entry_stored(&entry, flashAddr);
+		}
+
+		// Hand the cell back to the producers for the next lap of the ring
+		atomic_store_explicit(&pCell->seq, asyncDequeuePos + MAP_ASYNC_RING_SIZE, memory_order_release);
+		asyncDequeuePos++;
+		numDrained++;
+	}
+
+	// One flush commits the whole group
+	if (numDrained > 0 && 0 == ret)
+	{
+		ret = map_store_pending();
+	}
+
+	if (numDrained > 0)
+	{
+		pthread_mutex_lock(&asyncLock);
+		asyncDurablePos = asyncDequeuePos;
+		asyncError |= (ret != 0);
+		pthread_cond_broadcast(&asyncDurableCond);
+		pthread_mutex_unlock(&asyncLock);
+	}
+
+	return numDrained;
+}
+
+/**
+ * @brief Body of the flusher thread.
+ */
+static void* map_async_flusher(void* pArg)
+{
+	struct timespec wakeUp;
+
+	(void)pArg;
+
+	while (!atomic_load(&asyncStop))
+	{
+		if (map_async_drain() > 0)
+		{
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &wakeUp);
+		wakeUp.tv_nsec += MAP_ASYNC_IDLE_WAIT_NS;
+		if (wakeUp.tv_nsec >= 1000000000L)
+		{
+			wakeUp.tv_sec++;
+			wakeUp.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&asyncLock);
+		if (!atomic_load(&asyncStop))
+		{
+			pthread_cond_timedwait(&asyncWakeCond, &asyncLock, &wakeUp);
+		}
+		pthread_mutex_unlock(&asyncLock);
+	}
+
+	// Producers stopped before map_async_stop, whatever they queued is stored now
+	map_async_drain();
+
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Keeps the in-memory log up to date with an entry just stored.
+ */
+static int8_t map_entry_stored(const map_entry_t* pEntry, uint32_t flashAddr)
+{
+	if (entriesSinceCheckpoint < UINT16_MAX)
+	{
+		entriesSinceCheckpoint++;
+	}
+
+	int8_t ret;
+
+	if (txOpen)
+	{
+		return map_tx_track(pEntry->key, flashAddr);
+	}
+
+	MAP_INDEX_WRITE_LOCK();
+	ret = map_log_append(pEntry, flashAddr);
+	MAP_INDEX_UNLOCK();
+
+	return ret;
+}
+
+/**
+ * @brief Looks for the slot of a key in txAddrs.
+ */
+static int32_t map_tx_find(const char* pKey, uint32_t hash)
+{
+	uint8_t		payload[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+	int32_t		payloadLen;
+	map_entry_t entry;
+
+	for (uint16_t i = 0; i < txNumEntries; i++)
+	{
+		if (txKeyHash[i] != hash)
+		{
+			continue;
+		}
+
+		// Same hash, the key is only known from the stored entry
+		payloadLen = storage_retrieve_entry_payload(payload, sizeof(payload), txAddrs[i]);
+
+		if (payloadLen >= 0 && 0 == map_entry_decode(payload, (uint32_t)payloadLen, &entry) && 0 == strncmp(entry.key, pKey, MAP_MAX_KEY_LEN))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Records the address of an entry of the transaction, replacing an earlier entry of the same key.
+ */
+static int8_t map_tx_track(const char* pKey, uint32_t flashAddr)
+{
+	uint32_t hash = map_key_hash(pKey);
+	int32_t	 slot = map_tx_find(pKey, hash);
+
+	if (slot >= 0)
+	{
+		txAddrs[slot] = flashAddr;
+		return 0;
+	}
+
+	if (txNumEntries >= MAP_TX_MAX_ENTRIES)
+	{
+		return -1;
+	}
+
+	txAddrs[txNumEntries]	= flashAddr;
+	txKeyHash[txNumEntries] = hash;
+	txNumEntries++;
+
+	return 0;
+}
+
+/**
+ * @brief Appends the entries listed in txAddrs to the in-memory log.
+ */
+static int8_t map_tx_apply(uint16_t numEntries)
+{
+	uint8_t		payload[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+	int32_t		payloadLen;
+	map_entry_t entry;
+	int8_t		ret = 0;
+
+	for (uint16_t i = 0; i < numEntries && 0 == ret; i++)
+	{
+		payloadLen = storage_retrieve_entry_payload(payload, sizeof(payload), txAddrs[i]);
+
+		if (payloadLen < 0 || -1 == map_entry_decode(payload, (uint32_t)payloadLen, &entry))
+		{
+			ret = -1;
+		}
+		else
+		{
+			// A key beyond MAP_MAX_KEYS is left out, as map_log_rebuild does
+			(void)map_log_append(&entry, txAddrs[i]);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Prints an entry to the console.
+ */
+static void map_entry_print(const map_entry_view_t* pView)
+{
+	if (pView->type == MAP_TYPE_U32)
+	{
+		printf("Key: %s, valueU32: %d\r\n", pView->key, pView->valueU32);
+	}
+	else
+	{
+		printf("Key: %s, valueStr: %s\r\n", pView->key, pView->valueStr);
+	}
+}
+
+/**
+ * @brief Copies the latest entry of a key out of the arrays, or reads it back from flash.
+ */
+static int8_t map_key_entry(uint16_t keyNum, map_entry_t* pEntry)
+{
+#ifdef MAP_LAZY_VALUES
+	const map_entry_t* pStored = map_key_entry_ref(keyNum, pEntry);
+
+	if (pStored == NULL)
+	{
+		return -1;
+	}
+
+	if (pStored != pEntry)
+	{
+		*pEntry = *pStored;
+	}
+
+	return 0;
+#else
+	pEntry->type			 = pColumns->type[keyNum];
+	pEntry->entryDeletedFlag = ENTRY_NOT_DELETED_VALUE;
+	pEntry->valueU32		 = pColumns->valueU32[keyNum];
+	memcpy(pEntry->key, pColumns->key[keyNum], MAP_MAX_KEY_LEN);
+	memcpy(pEntry->valueStr, pColumns->valueStr[keyNum], MAP_MAX_VAL_LEN_STR);
+
+	return 0;
+#endif
+}
+
+#ifdef MAP_LAZY_VALUES
+/**
+ * @brief Finds the latest entry of a key in the value cache, or reads it from flash into a buffer.
+ */
+static const map_entry_t* map_key_entry_ref(uint16_t keyNum, map_entry_t* pBuf)
+{
+	uint8_t	 payload[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+	int32_t	 payloadLen;
+	uint32_t flashAddr = pColumns->flashAddr[keyNum];
+#ifdef MAP_VALUE_CACHE
+	int32_t line = map_cache_find(flashAddr);
+
+	if (line != -1)
+	{
+		cacheRef[line] = 1;
+		cacheStats.hits++;
+
+		return &cacheEntry[line];
+	}
+
+	cacheStats.misses++;
+#endif
+
+	payloadLen = storage_retrieve_entry_payload(payload, sizeof(payload), flashAddr);
+
+	if (payloadLen < 0 || -1 == map_entry_decode(payload, (uint32_t)payloadLen, pBuf))
+	{
+		return NULL;
+	}
+
+#ifdef MAP_VALUE_CACHE
+	map_cache_insert(flashAddr, pBuf);
+#endif
+
+	return pBuf;
+}
+#endif
+
+/**
+ * @brief Copies an entry into the arrays, at the position of its key.
+ */
+static void map_key_set(uint16_t keyNum, const map_entry_t* pEntry, uint32_t flashAddr)
+{
+	pColumns->flashAddr[keyNum] = flashAddr;
 
-//////////////////////////////////////////////////////////////////////
-//                         Private Global Variables
-//////////////////////////////////////////////////////////////////////
+#ifndef MAP_LAZY_VALUES
+	pColumns->type[keyNum]	   = pEntry->type;
+	pColumns->valueU32[keyNum] = pEntry->valueU32;
+	memcpy(pColumns->key[keyNum], pEntry->key, MAP_MAX_KEY_LEN);
+	memcpy(pColumns->valueStr[keyNum], pEntry->valueStr, MAP_MAX_VAL_LEN_STR);
+#else
+	// The value stays in flash
+	(void)pEntry;
+#endif
+}
 
-static uint16_t itemsInMap = 0;
+#ifdef MAP_VALUE_CACHE
+/**
+ * @brief Looks for the cache line holding an entry.
+ */
+static int32_t map_cache_find(uint32_t flashAddr)
+{
+	for (uint32_t line = 0; line < MAP_CACHE_LINES; line++)
+	{
+		if (cacheAddr[line] == flashAddr)
+		{
+			return (int32_t)line;
+		}
+	}
 
-//////////////////////////////////////////////////////////////////////
-//                      Public Functions definition
-//////////////////////////////////////////////////////////////////////
+	return -1;
+}
 
 /**
- * @brief Initializes the map module.
+ * @brief Caches an entry read from flash, evicting with the CLOCK hand when every line is used.
  */
-int8_t map_init(map_entry_log_t* pMapLog)
+static void map_cache_insert(uint32_t flashAddr, const map_entry_t* pEntry)
 {
-	if (-1 == storage_init())
+	int32_t line = map_cache_find(MAP_CACHE_FREE_ADDR);
+
+	if (line == -1)
 	{
-		return -1;
+		// Referenced lines get a second chance, the sweep ends within two turns
+		while (cacheRef[cacheHand])
+		{
+			cacheRef[cacheHand] = 0;
+			cacheHand			= (cacheHand + 1) % MAP_CACHE_LINES;
+		}
+
+		line	  = cacheHand;
+		cacheHand = (cacheHand + 1) % MAP_CACHE_LINES;
+		cacheStats.evictions++;
 	}
 
-	if (-1 == map_read_log(pMapLog))
+	cacheAddr[line]	 = flashAddr;
+	cacheRef[line]	 = 0;
+	cacheEntry[line] = *pEntry;
+}
+
+/**
+ * @brief Moves the line of a cached entry to another flash address.
+ */
+static void map_cache_move(uint32_t oldAddr, uint32_t newAddr, const map_entry_t* pEntry)
+{
+	int32_t line = map_cache_find(oldAddr);
+
+	if (line == -1)
 	{
-		return -1;
+		return;
 	}
 
-	return 0;
+	cacheAddr[line] = newAddr;
+
+	if (pEntry != NULL)
+	{
+		cacheEntry[line] = *pEntry;
+	}
 }
 
 /**
- * @brief 
+ * @brief Empties every cache line.
  */
-int8_t map_store_all()
+static void map_cache_clear()
 {
-	return storage_flush();
+	memset(cacheAddr, 0xFF, sizeof(cacheAddr));
+	memset(cacheRef, 0, sizeof(cacheRef));
+	cacheHand = 0;
 }
+#endif
 
 /**
- * @brief Adds a new map entry with a string value.
+ * @brief Probes the key index (linear probing) for a key.
  */
-int8_t map_add_entry_val_str(const char* pKey, const char* pVal)
+static int32_t map_index_find_slot(const char* pKey, uint32_t hash, map_entry_t* pEntry)
 {
-	map_entry_t entry;
-	size_t		keyLen = strlen(pKey);
-	size_t		valLen = strlen(pVal);
+	uint32_t slot = hash & MAP_INDEX_MASK;
+	uint8_t	 keyNum;
+#ifdef MAP_LAZY_VALUES
+	map_entry_t candidate;
+#endif
 
-	if (keyLen > MAP_MAX_KEY_LEN || valLen > MAP_MAX_VAL_LEN_STR)
+	for (uint32_t probe = 0; probe < MAP_INDEX_SIZE; probe++)
 	{
-		return -1;
+		keyNum = keyIndex[slot];
+
+		if (keyNum == MAP_INDEX_FREE)
+		{
+			return (int32_t)slot;
+		}
+
+#ifdef MAP_LAZY_VALUES
+		// The key is only known from the stored entry, which is read once the hashes match
+		if (pColumns->hash[keyNum] == hash && 0 == map_key_entry(keyNum, &candidate) && strncmp(candidate.key, pKey, MAP_MAX_KEY_LEN) == 0)
+		{
+			if (pEntry != NULL)
+			{
+				*pEntry = candidate;
+			}
+
+			return (int32_t)slot;
+		}
+#else
+		if (pColumns->hash[keyNum] == hash && strncmp(pColumns->key[keyNum], pKey, MAP_MAX_KEY_LEN) == 0)
+		{
+			if (pEntry != NULL)
+			{
+				(void)map_key_entry(keyNum, pEntry);
+			}
+
+			return (int32_t)slot;
+		}
+#endif
+
+		slot = (slot + 1) & MAP_INDEX_MASK;
 	}
 
-	memset(&entry, 0, sizeof(entry));
+	return -1;
+}
 
-	entry.type			   = MAP_TYPE_STR;
-	entry.entryDeletedFlag = ENTRY_NOT_DELETED_VALUE;
-	strncpy(entry.key, pKey, MAP_MAX_KEY_LEN - 1);
-	strncpy(entry.valueStr, pVal, MAP_MAX_VAL_LEN_STR - 1);
-	entry.valueU32 = 0;
+/**
+ * @brief Probes the key index for the key pointing at an entry, flash addresses are unique.
+ */
+static int32_t map_index_find_addr(uint32_t hash, uint32_t flashAddr)
+{
+	uint32_t slot = hash & MAP_INDEX_MASK;
+	uint8_t	 keyNum;
 
-	if (-1 == storage_store_entry((void*)&entry, sizeof(entry)))
+	for (uint32_t probe = 0; probe < MAP_INDEX_SIZE && keyIndex[slot] != MAP_INDEX_FREE; probe++)
 	{
-		return -1;
+		keyNum = keyIndex[slot];
+
+		if (pColumns->hash[keyNum] == hash && pColumns->flashAddr[keyNum] == flashAddr)
+		{
+			return keyNum;
+		}
+
+		slot = (slot + 1) & MAP_INDEX_MASK;
 	}
 
-	return 0;
+	return -1;
 }
 
 /**
- * @brief Adds a new map entry with a uint32_t value.
+ * @brief Frees a slot of the key index, linear probing needs no deleted markers.
  */
-int8_t map_add_entry_val_u32(const char* pKey, uint32_t valueU32)
+static void map_index_remove(uint32_t slot)
 {
-	map_entry_t entry;
-	size_t		keyLen = strlen(pKey);
+	uint32_t next = (slot + 1) & MAP_INDEX_MASK;
+	uint32_t home;
 
-	// Check parameters validity
-	if (keyLen > MAP_MAX_KEY_LEN)
+	while (keyIndex[next] != MAP_INDEX_FREE)
 	{
-		return -1;
+		home = pColumns->hash[keyIndex[next]] & MAP_INDEX_MASK;
+
+		// A key whose probe starts after the freed slot must stay where it is
+		if (((next - home) & MAP_INDEX_MASK) >= ((next - slot) & MAP_INDEX_MASK))
+		{
+			keyIndex[slot] = keyIndex[next];
+			slot		   = next;
+		}
+
+		next = (next + 1) & MAP_INDEX_MASK;
 	}
 
-	memset(&entry, 0, sizeof(entry));
+	keyIndex[slot] = MAP_INDEX_FREE;
+}
+
+/**
+ * @brief Tells whether a key is held by the arrays.
+ */
+static uint8_t map_key_known(const char* pKey)
+{
+	int32_t slot = map_index_find_slot(pKey, map_key_hash(pKey), NULL);
 
-	entry.type = MAP_TYPE_U32;
-	strncpy(entry.key, pKey, MAP_MAX_KEY_LEN - 1);
-	entry.valueU32 = valueU32;
+	return (slot != -1 && keyIndex[slot] != MAP_INDEX_FREE) ? 1 : 0;
+}
 
-	if (-1 == storage_store_entry((void*)&entry, sizeof(entry)))
+/**
+ * @brief Tells whether the arrays have room for the key of an entry about to be stored.
+ */
+static int8_t map_key_room(const char* pKey, uint16_t numReserved)
+{
+	// Far from MAP_MAX_KEYS any key fits, map_read_log was not called yet when nothing is indexed
+	if (pIndexedLog == NULL || itemsInMap + numReserved < MAP_MAX_KEYS)
 	{
-		return -1;
+		return 0;
 	}
 
-	return 0;
+	return map_key_known(pKey) ? 0 : -1;
 }
 
 /**
- * @brief De-initializes the map, freeing allocated memory.
+ * @brief Updates the entry of a known key, or appends a new key and indexes it.
  */
-int8_t map_deInit(map_entry_log_t* pMapLog)
+static int8_t map_log_append(const map_entry_t* pEntry, uint32_t flashAddr)
 {
-	map_entry_log_t* current = pMapLog->next;
-	map_entry_log_t* next;
+	uint32_t hash;
+	int32_t	 slot;
+	uint16_t keyNum;
+
+	// map_read_log was not called yet, nothing to keep up to date
+	if (pIndexedLog == NULL)
+	{
+		return 0;
+	}
+
+	hash = map_key_hash(pEntry->key);
+	slot = map_index_find_slot(pEntry->key, hash, NULL);
 
-	while (current != NULL)
+	// A tombstone drops its key, nothing points at it anymore and the garbage collector reclaims it
+	if (pEntry->entryDeletedFlag == ENTRY_DELETED_VALUE)
 	{
-		next = current->next;
+		if (slot != -1 && keyIndex[slot] != MAP_INDEX_FREE)
+		{
+			map_log_remove((uint32_t)slot);
+		}
 
-		free(current);
+		return 0;
+	}
 
-		current = next;
+	if (slot == -1)
+	{
+		return -1;
 	}
 
-	pMapLog->next = NULL;
+	// Known key: it keeps its position and takes the new value
+	if (keyIndex[slot] != MAP_INDEX_FREE)
+	{
+		keyNum = keyIndex[slot];
+
+#ifdef MAP_VALUE_CACHE
+		// A hot key stays cached with its new value
+		map_cache_move(pColumns->flashAddr[keyNum], flashAddr, pEntry);
+#endif
+
+		map_key_set(keyNum, pEntry, flashAddr);
 
-	return storage_deInit();
+		return 0;
+	}
+
+	if (itemsInMap >= MAP_MAX_KEYS)
+	{
+		return -1;
+	}
+
+	keyNum				   = itemsInMap++;
+	pColumns->hash[keyNum] = hash;
+	map_key_set(keyNum, pEntry, flashAddr);
+	keyIndex[slot] = (uint8_t)keyNum;
+
+	return 0;
 }
 
 /**
- * @brief Reads all entries from storage and populates the in-memory
- *        linked list.
- * 
- * \todo current implementation doesnt deal properly with memory corruption, 
- * if an entry was corrupted, it stops reading the log and ignores next possible values
+ * @brief Drops the key held by a slot from the arrays and the key index.
  */
-int8_t map_read_log(map_entry_log_t* pMapLog)
+static void map_log_remove(uint32_t slot)
 {
-	map_entry_t		 entry;
-	map_entry_log_t* pCurrentNode = pMapLog;
-	uint32_t		 entryNum	  = 0;
-	uint8_t			 firstEntry	  = 1;
+	uint8_t	 keyNum	  = keyIndex[slot];
+	uint16_t numAfter = itemsInMap - keyNum - 1;
+
+#ifdef MAP_VALUE_CACHE
+	// Moving a line to MAP_CACHE_FREE_ADDR empties it
+	map_cache_move(pColumns->flashAddr[keyNum], MAP_CACHE_FREE_ADDR, NULL);
+#endif
+
+	map_index_remove(slot);
 
-	while (-1 != storage_retrieve_entry_payload((void*)&entry, sizeof(map_entry_t), entryNum))
+	// The keys after it move down one position, they keep their order of first appearance
+	memmove(&pColumns->hash[keyNum], &pColumns->hash[keyNum + 1], numAfter * sizeof(pColumns->hash[0]));
+	memmove(&pColumns->flashAddr[keyNum], &pColumns->flashAddr[keyNum + 1], numAfter * sizeof(pColumns->flashAddr[0]));
+#ifndef MAP_LAZY_VALUES
+	memmove(&pColumns->type[keyNum], &pColumns->type[keyNum + 1], numAfter * sizeof(pColumns->type[0]));
+	memmove(&pColumns->valueU32[keyNum], &pColumns->valueU32[keyNum + 1], numAfter * sizeof(pColumns->valueU32[0]));
+	memmove(&pColumns->key[keyNum], &pColumns->key[keyNum + 1], numAfter * sizeof(pColumns->key[0]));
+	memmove(&pColumns->valueStr[keyNum], &pColumns->valueStr[keyNum + 1], numAfter * sizeof(pColumns->valueStr[0]));
+#endif
+
+	for (slot = 0; slot < MAP_INDEX_SIZE; slot++)
 	{
-		if (firstEntry)
+		if (keyIndex[slot] != MAP_INDEX_FREE && keyIndex[slot] > keyNum)
 		{
-			pCurrentNode->entry		  = entry;
-			pCurrentNode->latestEntry = 1;
-			pCurrentNode->next		  = NULL;
-			firstEntry				  = 0;
+			keyIndex[slot]--;
 		}
-		else
+	}
+
+	itemsInMap--;
+}
+
+/**
+ * @brief Makes the arrays holding the keys available, allocating them if needed.
+ */
+static int8_t map_columns_init()
+{
+#ifndef MAP_POOL_STATIC
+	if (pColumns == NULL)
+	{
+		pColumns = (map_columns_t*)malloc(sizeof(map_columns_t));
+		if (pColumns == NULL)
 		{
-			pCurrentNode->next		  = (map_entry_log_t*)malloc(sizeof(map_entry_log_t));
-			pCurrentNode			  = pCurrentNode->next;
-			pCurrentNode->entry		  = entry;
-			pCurrentNode->latestEntry = 1;
-			pCurrentNode->next		  = NULL;
+			return -1;
 		}
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * @brief Returns the memory of the arrays holding the keys.
+ */
+static void map_columns_deInit()
+{
+#ifndef MAP_POOL_STATIC
+	free(pColumns);
+	pColumns = NULL;
+#endif
+}
+
+/**
+ * @brief Rebuilds the arrays from the latest checkpoint and the entries stored after it.
+ */
+static int8_t map_log_rebuild(map_entry_log_t* pMapLog)
+{
+	map_entry_t entry;
+	const void* pPayload;
+	uint32_t	payloadLen;
+	int32_t		checkpointLen;
+	uint16_t	recordTxId;
+	uint16_t	replayTxId = 0;
+	uint8_t		recordTx;
 
-		itemsInMap++;
-		entryNum++;
+	if (-1 == map_columns_init())
+	{
+		return -1;
 	}
 
-	// Nothing read, stop here
-	if (firstEntry)
+	// Drop whatever a previous read left in memory
+	map_log_release(pMapLog);
+
+	pIndexedLog = pMapLog;
+
+	// A transaction left open is dropped, txAddrs now tracks the transaction being replayed
+	txOpen		 = 0;
+	txNumEntries = 0;
+	txId		 = 0;
+
+	// Start from the latest checkpoint when there is a usable one, otherwise read the whole log
+	checkpointLen = storage_checkpoint_load(checkpointAddrs, sizeof(checkpointAddrs), &logIter);
+
+	if (checkpointLen >= 0 && 0 == map_log_load_checkpoint((uint32_t)checkpointLen))
 	{
-		return 0;
+		entriesSinceCheckpoint = 0;
 	}
+	else
+	{
+		map_log_release(pMapLog);
+		txId	 = 0;
+		storage_iter_init(&logIter);
 
-	pCurrentNode		   = pMapLog;
-	map_entry_log_t* outer = pMapLog;
+		entriesSinceCheckpoint = MAP_CHECKPOINT_INTERVAL;
+	}
 
-	while (outer != NULL)
+	// Single forward pass, the key index doubles as the set of keys already seen:
+	// a later entry of a key overwrites its value.
+	while (-1 != storage_iter_next(&logIter, &pPayload, &payloadLen))
 	{
-		map_entry_log_t* inner = outer->next;
-		while (inner != NULL)
+		recordTx = map_record_tx(pPayload, payloadLen, &recordTxId);
+
+		if (recordTx != 0)
 		{
-			if (strcmp(outer->entry.key, inner->entry.key) == 0)
+			// Ids grow by one per transaction, the next one follows the latest seen
+			if ((uint16_t)(recordTxId - txId) < 0x8000)
 			{
-				outer->latestEntry = 0;
-				break;
+				txId = recordTxId + 1;
+			}
+
+			// Entries of a transaction only apply once its commit marker is read
+			if (recordTx == 2)
+			{
+				if (recordTxId == replayTxId && -1 == map_tx_apply(txNumEntries))
+				{
+					return -1;
+				}
+
+				txNumEntries = 0;
+				continue;
+			}
+
+			// A new transaction means the previous one was never committed
+			if (recordTxId != replayTxId)
+			{
+				replayTxId	 = recordTxId;
+				txNumEntries = 0;
 			}
-			inner = inner->next;
 		}
-		outer = outer->next;
+
+		if (-1 == map_entry_decode(pPayload, payloadLen, &entry))
+		{
+			continue;
+		}
+
+		if (recordTx != 0)
+		{
+			(void)map_tx_track(entry.key, storage_iter_addr(&logIter));
+			continue;
+		}
+
+		// A key beyond MAP_MAX_KEYS is left out rather than losing every other key
+		(void)map_log_append(&entry, storage_iter_addr(&logIter));
+
+		if (entriesSinceCheckpoint < UINT16_MAX)
+		{
+			entriesSinceCheckpoint++;
+		}
 	}
 
+	txNumEntries = 0;
+
 	return 0;
 }
 
 /**
- * @brief Prints the contents of the in-memory map log.
+ * @brief Drops every key and clears the key index.
  */
-void map_print_log(map_entry_log_t* pMapLog)
+static void map_log_release(map_entry_log_t* pMapLog)
+{
+	// The handle chains no entries, callers walking it as a list find it empty
+	pMapLog->next = NULL;
+
+	memset(keyIndex, MAP_INDEX_FREE, sizeof(keyIndex));
+#ifdef MAP_VALUE_CACHE
+	map_cache_clear();
+#endif
+	itemsInMap = 0;
+}
+
+/**
+ * @brief Stores a checkpoint with the flash address of the latest entry of every key.
+ */
+static int8_t map_checkpoint()
 {
-	uint8_t keyPresentFlag = 0;
+	uint32_t numWords = 0;
 
-	while (pMapLog && itemsInMap > 0)
+	// map_read_log was not called yet, there is nothing to take a checkpoint of.
+	// Entries of an open transaction are after the checkpoint and must be replayed with their commit marker.
+	if (pIndexedLog == NULL || txOpen)
 	{
-		if (1 == pMapLog->latestEntry)
-		{
-			if (pMapLog->entry.type == MAP_TYPE_U32)
-			{
-				printf("Key: %s, valueU32: %d\r\n", pMapLog->entry.key, pMapLog->entry.valueU32);
-			}
-			else
-			{
-				printf("Key: %s, valueStr: %s\r\n", pMapLog->entry.key, pMapLog->entry.valueStr);
-			}
-		}
+		return 0;
+	}
+
+	checkpointAddrs[numWords++] = MAP_CHECKPOINT_TX_TAG | txId;
+
+	memcpy(&checkpointAddrs[numWords], pColumns->flashAddr, itemsInMap * sizeof(uint32_t));
+	numWords += itemsInMap;
 
-		pMapLog = pMapLog->next;
+	if (-1 == storage_checkpoint_write(checkpointAddrs, numWords * sizeof(uint32_t)))
+	{
+		return -1;
 	}
+
+	entriesSinceCheckpoint = 0;
+
+	return 0;
 }
 
 /**
- * @brief Retrieves a map entry by its sequential number in the log.
+ * @brief Rebuilds the arrays from the entries listed by a checkpoint.
  */
-int8_t map_get_entry_via_num(map_entry_log_t* pMapLog, uint16_t entryNum, map_entry_t* pEntry)
+static int8_t map_log_load_checkpoint(uint32_t checkpointLen)
 {
-	map_entry_log_t* pCurrentNode = pMapLog;
-	uint16_t		 currentNum	  = 0;
+	uint8_t		payload[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+	int32_t		payloadLen;
+	map_entry_t entry;
+	uint32_t	numWords = checkpointLen / sizeof(uint32_t);
+	uint32_t	i		 = 0;
 
-	if (pMapLog == NULL || pEntry == NULL)
+	// Checkpoints written before transactions only hold addresses
+	if (numWords > 0 && (checkpointAddrs[0] & 0xFFFF0000) == MAP_CHECKPOINT_TX_TAG)
 	{
-		return -1;
+		txId = (uint16_t)checkpointAddrs[0];
+		i++;
 	}
 
-	while (pCurrentNode != NULL)
+	for (; i < numWords; i++)
 	{
-		if (currentNum == entryNum)
+		payloadLen = storage_retrieve_entry_payload(payload, sizeof(payload), checkpointAddrs[i]);
+
+		if (payloadLen < 0 || -1 == map_entry_decode(payload, (uint32_t)payloadLen, &entry))
 		{
-			*pEntry = pCurrentNode->entry;
-			return 0;
+			return -1;
 		}
 
-		pCurrentNode = pCurrentNode->next;
-		currentNum++;
+		if (-1 == map_log_append(&entry, checkpointAddrs[i]))
+		{
+			return -1;
+		}
 	}
 
-	return -1;
+	return 0;
 }
 
 /**
- * @brief Retrieves a map entry by its key.
+ * @brief An entry is live while its key points at it.
  */
-int8_t map_get_entry_via_key(map_entry_log_t* pMapLog, const char* key, map_entry_t* pEntry)
+static uint8_t map_gc_is_live(uint32_t entryAddr, const void* pPayload, uint32_t payloadLen, void* pCtx)
 {
-	map_entry_log_t* pCurrentNode = pMapLog;
+	map_entry_t entry;
+	uint16_t	recordTxId;
 
-	if (pMapLog == NULL || key == NULL || pEntry == NULL)
+	(void)pCtx;
+
+	// Without the in-memory log there is no telling superseded entries apart
+	if (pIndexedLog == NULL)
 	{
-		return -1;
+		return 1;
+	}
+
+	// Commit markers are dropped, GC reaches them only after the entries they commit
+	if (-1 == map_entry_decode(pPayload, payloadLen, &entry))
+	{
+		return 0;
 	}
 
-	// Iterate through the linked list
-	while (pCurrentNode != NULL)
+	// Entries of the open transaction are not in the map yet
+	if (txOpen && 1 == map_record_tx(pPayload, payloadLen, &recordTxId) && recordTxId == txId)
 	{
-		// Compare the key of the current entry with the provided key
-		if (strcmp(pCurrentNode->entry.key, key) == 0)
+		for (uint16_t i = 0; i < txNumEntries; i++)
 		{
-			*pEntry = pCurrentNode->entry;
-			return 0;
+			if (txAddrs[i] == entryAddr)
+			{
+				return 1;
+			}
 		}
 
-		pCurrentNode = pCurrentNode->next;
+		return 0;
 	}
 
-	return -1;
+	// No key points at a tombstone, older records of its key are collected before it
+	return map_index_find_addr(map_key_hash(entry.key), entryAddr) != -1;
 }
 
 /**
- * @brief 
+ * @brief Points the entry's key at the copy made by the garbage collector.
  */
-int8_t map_delete_entry(map_entry_log_t* pMapLog, const char* key)
+static void map_gc_relocated(uint32_t oldAddr, uint32_t newAddr, const void* pPayload, uint32_t payloadLen, void* pCtx)
+{
+	map_entry_t entry;
+	int32_t		keyNum;
+
+	(void)pCtx;
+
+	if (pIndexedLog == NULL || -1 == map_entry_decode(pPayload, payloadLen, &entry))
+	{
+		return;
+	}
+
+	keyNum = map_index_find_addr(map_key_hash(entry.key), oldAddr);
+
+	if (keyNum != -1)
+	{
+		pColumns->flashAddr[keyNum] = newAddr;
+#ifdef MAP_VALUE_CACHE
+		map_cache_move(oldAddr, newAddr, NULL);
+#endif
+	}
+
+	for (uint16_t i = 0; txOpen && i < txNumEntries; i++)
+	{
+		if (txAddrs[i] == oldAddr)
+		{
+			txAddrs[i] = newAddr;
+		}
+	}
+}
+
+/**
+ * @brief Drops the transaction tag of committed entries being copied.
+ */
+static uint32_t map_gc_rewrite(const void* pPayload, uint32_t payloadLen, void* pNewPayload, void* pCtx)
 {
-	//
-}
\ No newline at end of file
+	const uint8_t* pBytes = (const uint8_t*)pPayload;
+	uint8_t*	   pNew	  = (uint8_t*)pNewPayload;
+	uint16_t	   recordTxId;
+
+	(void)pCtx;
+
+	// Only entries found live in the list are known to be committed
+	if (pIndexedLog == NULL || 1 != map_record_tx(pPayload, payloadLen, &recordTxId) || (txOpen && recordTxId == txId))
+	{
+		return 0;
+	}
+
+	pNew[0] = pBytes[0] & (uint8_t)~MAP_RECORD_TX;
+	memcpy(&pNew[1], &pBytes[3], payloadLen - 3);
+
+	return payloadLen - 2;
+}
@@ -22,22 +22,36 @@
 //////////////////////////////////////////////////////////////////////
 
 #include "storage.h"
+#include "crc32.h"
 #include "mx25_flash_driver.h"
+#include "stddef.h"
 #include "stdlib.h"
 #include "string.h"
+#include <time.h>
 
 //////////////////////////////////////////////////////////////////////
 //                             Macros
 //////////////////////////////////////////////////////////////////////
 
-#define MAP_NUM_ENTRIES 100															/// Maximum number of map entries the storage can hold.
-#define STORAGE_ENTRY_SIZE_BYTES (sizeof(storage_entry_t))							/// Total size of a single storage entry, including header, payload, and metadata.
-#define MAP_RESERVED_SPACE (MAP_NUM_ENTRIES * STORAGE_ENTRY_SIZE_BYTES)				/// Total reserved space in flash for all map entries.
-#define FLASH_PAGE_START_ADDRESS 0x00000000											/// The starting address in flash memory where storage begins.
-#define FLASH_PAGE_LOG_LAST_ADDRESS (FLASH_PAGE_START_ADDRESS + MAP_RESERVED_SPACE) /// The end address of the reserved storage space.
-#define ENTRY_HEADER_VALUE 0xDEADBEEF												/// Magic number used to identify a valid storage entry.
+#define FLASH_PAGE_START_ADDRESS (STORAGE_FIRST_SECTOR * MX25_FLASH_SECTOR_SIZE)		/// The starting address in flash memory where storage begins.
+#define FLASH_PAGE_LOG_LAST_ADDRESS (FLASH_PAGE_START_ADDRESS + STORAGE_RESERVED_SPACE) /// The end address of the reserved storage space.
+#define STORAGE_SECTOR_MAGIC 0x4C4F4753													/// Magic number starting the header of every sector in use.
+#define STORAGE_SECTOR_HEADER_SIZE (sizeof(storage_sector_header_t))					/// Bytes before the first record of a sector.
+#define STORAGE_CHECKPOINT_MAGIC 0x43484B50												/// Magic number starting every checkpoint.
+#define STORAGE_CHECKPOINT_FIRST_ADDR FLASH_PAGE_LOG_LAST_ADDRESS						/// Address of the first checkpoint sector, right after the log.
+#define STORAGE_CHECKPOINT_HEADER_SIZE (sizeof(storage_checkpoint_header_t))			/// Bytes before the data of a checkpoint.
+#define STORAGE_LEGACY_LOG_SIZE 11400													/// Bytes used by the log before the sector layout, records packed from the first address.
+#define STORAGE_LEGACY_SECTORS ((STORAGE_LEGACY_LOG_SIZE + MX25_FLASH_SECTOR_SIZE - 1) / MX25_FLASH_SECTOR_SIZE) /// Sectors covered by a log without sector layout.
+#define ENTRY_HEADER_VALUE 0xDEADBEEF													/// Magic number used to identify a valid storage entry (record format version 1).
+#define STORAGE_RECORD_MAGIC 0xC0DE														/// Magic number starting every record of format version 2 and later.
+#define STORAGE_RECORD_VERSION_LEGACY 1													/// Format version of the fixed size storage_entry_t records.
+#define STORAGE_RECORD_VERSION 2														/// Format version of the records written by this version.
+#define STORAGE_RECORD_HEADER_SIZE (sizeof(storage_record_header_t))					/// Bytes before the payload of a record.
+#define STORAGE_RECORD_MAX_SIZE (STORAGE_RECORD_OVERHEAD + MAX_STORAGE_ENTRY_PAYLOAD_LEN) /// Size of the longest record.
 #define ENTRY_NOT_DELETED_VALUE 0													/// Value indicating that an entry is not deleted.
 #define ENTRY_DELETED_VALUE 1														/// Value indicating that an entry has been marked as deleted.
+#define STORAGE_NO_SECTOR 0xFFFFFFFF												/// bufferSectorAddr value while pTempBuffer mirrors no sector.
+#define STORAGE_HEAD_SEARCH_CHUNK 8														/// Bytes checked for the erased value at every step of the head search.
 
 //////////////////////////////////////////////////////////////////////
 //                              Types
@@ -54,41 +68,327 @@ typedef struct storage_entry
 	uint32_t crc32;
 } __attribute__((__packed__)) storage_entry_t;
 
+/**
+ * @brief Header of a variable length record, followed by the payload and the CRC32
+ *        of the header and payload.
+ */
+typedef struct storage_record_header
+{
+	uint16_t magic;
+	uint8_t	 version;
+	uint8_t	 dataLen;
+} __attribute__((__packed__)) storage_record_header_t;
+
+/**
+ * @brief Header at the start of every sector of the circular log. A sector is in use
+ *        when the magic and the CRC32 of magic and sequence number match.
+ */
+typedef struct storage_sector_header
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t crc32;
+} __attribute__((__packed__)) storage_sector_header_t;
+
+/**
+ * @brief Header of a checkpoint, followed by the data and the CRC32 of the header and data.
+ */
+typedef struct storage_checkpoint_header
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t logSeq;
+	uint32_t logAddr;
+	uint16_t logSector;
+	uint16_t dataLen;
+} __attribute__((__packed__)) storage_checkpoint_header_t;
+
 //////////////////////////////////////////////////////////////////////
 //                         Private Global Variables
 //////////////////////////////////////////////////////////////////////
 
-static storage_entry_t entry;									 ///
-static uint32_t		   entryAddrHead = FLASH_PAGE_START_ADDRESS; /// Address in memory of the last valid entry
-static uint32_t		   entryAddrTail = FLASH_PAGE_START_ADDRESS; /// Address in memory of the last entry
-static uint8_t		   pTempBuffer[MX25_FLASH_SECTOR_SIZE];		 /// This buffer is used to store the entries temporaly
+static uint32_t					 entryAddrHead	  = FLASH_PAGE_START_ADDRESS; /// Address in memory where the next entry is appended
+static uint32_t					 entryAddrTail	  = FLASH_PAGE_START_ADDRESS; /// Address in memory of the oldest entry (first entry of the tail sector)
+static uint16_t					 headSector		  = 0;						  /// Log sector entries are appended to
+static uint16_t					 tailSector		  = 0;						  /// Log sector holding the oldest entries
+static uint16_t					 activeSectors	  = 0;						  /// Number of log sectors in use, from tailSector to headSector
+static uint32_t					 headSeq		  = 0;						  /// Sequence number of the head sector
+static uint8_t					 pTempBuffer[MX25_FLASH_SECTOR_SIZE];		  /// This buffer is used to store the entries temporaly
+static uint32_t					 bufferSectorAddr = STORAGE_NO_SECTOR;		  /// Address of the sector mirrored by pTempBuffer
+static uint32_t					 bufferDirtyStart = MX25_FLASH_SECTOR_SIZE;	  /// Offset in pTempBuffer of the first byte not yet flushed
+static uint32_t					 bufferDirtyEnd	  = 0;						  /// Offset in pTempBuffer after the last byte not yet flushed
+static storage_iter_t			 scanIter;									  /// Iterator used by storage_init to find the end of the log
+static uint8_t					 gcRunning		  = 0;						  /// Set while live entries are copied, keeps the collector from recursing
+static storage_gc_is_live_cb_t	 gcIsLive		  = NULL;					  /// Tells live entries from superseded ones, NULL keeps every entry
+static storage_gc_relocated_cb_t gcRelocated	  = NULL;					  /// Told about every entry copied by the collector
+static storage_gc_rewrite_cb_t	 gcRewrite		  = NULL;					  /// May change live entries before the collector copies them
+static void*					 gcCtx			  = NULL;					  /// Context passed to the collector callbacks
+static uint8_t					 ckptFound		  = 0;						  /// Set when a valid checkpoint was found or written
+static storage_checkpoint_header_t ckptHeader;								  /// Header of the latest checkpoint
+static uint32_t					 ckptAddr		  = 0;						  /// Address of the latest checkpoint
+static uint32_t					 ckptNextAddr	  = STORAGE_CHECKPOINT_FIRST_ADDR; /// Address where the next checkpoint is appended
+static storage_flush_cb_t		 flushDoneCb	  = NULL;					  /// Callback of the flush in flight
+static void*					 flushDoneCtx	  = NULL;					  /// Context of the flush in flight
+static uint32_t					 flushChunksLeft  = 0;						  /// Page programs of the flush in flight not done yet, only changed by the I/O context once started
+static int8_t					 flushStatus	  = 0;						  /// Result of the page programs of the flush in flight
+static storage_stats_t			 stats;										  /// I/O and wear counters reported by storage_get_stats
 
 //////////////////////////////////////////////////////////////////////
 //                         Private Functions declaration
 //////////////////////////////////////////////////////////////////////
 
 /**
- * @name crc_calculate_32
- * @brief Calculates the CRC32 checksum for a given data buffer.
+ * @name storage_get_last_entry_addr
+ * @brief Scans the head sector to find the address of the last valid entry.
+ * 
+ * @details This function iterates through the head sector from a known entry,
+ *          validating each entry's header and CRC to find the first empty or
+ *          corrupt slot, which indicates the end of the log. Entries are only
+ *          programmed over erased flash, a corrupt slot (e.g. a write cut short)
+ *          closes the head sector.
  * 
- * @param data Pointer to the data for which to calculate the CRC.
- * @param len Length of the data in bytes.
+ * @param startAddr Address of an entry of the head sector, or of the end of the log.
  * 
- * @return The calculated 32-bit CRC value.
+ * @return The address of the next available slot for a new entry, the end of the
+ *         head sector when the rest of it is not erased.
  */
-static uint32_t crc_calculate_32(const void* data, size_t len);
+static uint32_t storage_get_last_entry_addr(uint32_t startAddr);
 
 /**
- * @name storage_get_last_entry_addr
- * @brief Scans the flash memory to find the address of the last valid entry.
+ * @name storage_find_head_addr
+ * @brief Finds the end of the log in the head sector with a binary search on erased flash.
  * 
- * @details This function iterates through the storage area from the beginning,
- *          validating each entry's header and CRC to find the first empty or
- *          corrupt slot, which indicates the end of the log.
+ * @details Flash after the last entry is erased, the first erased chunk of the sector is
+ *          searched with O(log n) reads. The end is confirmed by a valid entry ending right
+ *          before the erased bytes, otherwise (corrupted entry, payload bytes looking erased)
+ *          storage_get_last_entry_addr is used.
+ * 
+ * @param startAddr Address of an entry of the head sector, or of the end of the log.
  * 
  * @return The address of the next available slot for a new entry.
  */
-static uint32_t storage_get_last_entry_addr();
+static uint32_t storage_find_head_addr(uint32_t startAddr);
+
+/**
+ * @name storage_chunk_erased
+ * @brief Checks whether a chunk of the log reads as erased.
+ * 
+ * @param addr First address of the chunk.
+ * @param size Size of the chunk in bytes, at most STORAGE_HEAD_SEARCH_CHUNK.
+ * 
+ * @return 1 if every byte is MX25_FLASH_ERASE_CELL_VAL, 0 otherwise or on read failure.
+ */
+static uint8_t storage_chunk_erased(uint32_t addr, uint32_t size);
+
+/**
+ * @name storage_sector_addr
+ * @brief Start address in flash of a log sector.
+ * 
+ * @param sector Log sector, 0 to STORAGE_NUM_SECTORS - 1.
+ * 
+ * @return The address of the sector header.
+ */
+static uint32_t storage_sector_addr(uint16_t sector);
+
+/**
+ * @name storage_sector_seq
+ * @brief Reads and validates the header of a log sector.
+ * 
+ * @param sector Log sector, 0 to STORAGE_NUM_SECTORS - 1.
+ * @param pSeq Set to the sequence number of the sector.
+ * 
+ * @retval 0 if the sector is in use, -1 if it is erased, retired or corrupted.
+ */
+static int8_t storage_sector_seq(uint16_t sector, uint32_t* pSeq);
+
+/**
+ * @name storage_locate_log
+ * @brief Finds the tail and head sectors and the end of the log.
+ * 
+ * @details The head is the sector with the highest sequence number, the tail is found
+ *          walking back while the sequence numbers are consecutive. A log without any
+ *          sector header but with an entry at the first address is migrated.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_locate_log();
+
+/**
+ * @name storage_checkpoint_locate
+ * @brief Finds the latest valid checkpoint and the address where the next one is appended.
+ */
+static void storage_checkpoint_locate();
+
+/**
+ * @name storage_checkpoint_crc
+ * @brief CRC32 of a checkpoint header and its data.
+ * 
+ * @param pHeader Header of the checkpoint.
+ * @param pData Data of the checkpoint, pHeader->dataLen bytes.
+ * 
+ * @return The CRC32 stored after the data.
+ */
+static uint32_t storage_checkpoint_crc(const storage_checkpoint_header_t* pHeader, const void* pData);
+
+/**
+ * @name storage_migrate_legacy_log
+ * @brief Copies the entries of a log written before the sector layout into log sectors.
+ * 
+ * @details Entries are copied after the sectors used by the old log, which are
+ *          erased once the copy has been flushed.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_migrate_legacy_log();
+
+/**
+ * @name storage_open_head_sector
+ * @brief Starts a new head sector after the current one, collecting garbage first if needed.
+ * 
+ * @retval 0 on success, -1 if every sector holds live entries.
+ */
+static int8_t storage_open_head_sector();
+
+/**
+ * @name storage_gc_collect
+ * @brief Copies the live entries of the tail sector to the head and retires the tail sector.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_gc_collect();
+
+/**
+ * @name storage_record_build
+ * @brief Builds a record of the current format around a payload.
+ * 
+ * @param pRecord Output buffer, at least STORAGE_RECORD_MAX_SIZE bytes.
+ * @param pPayload Payload of the record.
+ * @param payloadLen Length of the payload in bytes.
+ * 
+ * @return The size of the record in bytes.
+ */
+static uint32_t storage_record_build(uint8_t* pRecord, const void* pPayload, uint32_t payloadLen);
+
+/**
+ * @name storage_record_size
+ * @brief Size in flash of the record starting with a given header.
+ * 
+ * @param pRecord Start of the record, at least STORAGE_RECORD_HEADER_SIZE bytes.
+ * 
+ * @return The size of the record in bytes, 0 if pRecord does not start a record.
+ */
+static uint32_t storage_record_size(const uint8_t* pRecord);
+
+/**
+ * @name storage_record_payload
+ * @brief Validates a complete record and locates its payload.
+ * 
+ * @param pRecord Start of the record, storage_record_size(pRecord) bytes.
+ * @param ppPayload Set to the payload of the record.
+ * @param pPayloadLen Set to the length of the payload in bytes.
+ * 
+ * @retval 0 if the record is valid, -1 if its length or CRC is wrong.
+ */
+static int8_t storage_record_payload(const uint8_t* pRecord, const uint8_t** ppPayload, uint32_t* pPayloadLen);
+
+/**
+ * @name storage_iter_fill
+ * @brief Makes sure the iterator window holds a number of bytes from its current entry address.
+ * 
+ * @param pIter Iterator.
+ * @param size Number of bytes needed.
+ * 
+ * @retval 0 on success, -1 if the bytes are past the reserved space or could not be read.
+ */
+static int8_t storage_iter_fill(storage_iter_t* pIter, uint32_t size);
+
+/**
+ * @name storage_read
+ * @brief Reads the log as it would be after a flush.
+ * 
+ * @details Data comes from flash, bytes of the sector mirrored by pTempBuffer
+ *          come from the buffer so entries not flushed yet are visible.
+ * 
+ * @param addr First address to read.
+ * @param pBuffer Destination buffer.
+ * @param size Number of bytes to read.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_read(uint32_t addr, uint8_t* pBuffer, uint32_t size);
+
+/**
+ * @name storage_program
+ * @brief Programs data into erased flash, split at page boundaries.
+ * 
+ * @param addr First address to program.
+ * @param pData Data to be programmed.
+ * @param size Number of bytes to program.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_program(uint32_t addr, const uint8_t* pData, uint32_t size);
+
+/**
+ * @name storage_flash_read
+ * @brief Reads from flash, counting the read.
+ * 
+ * @param addr The starting address to read from.
+ * @param pBuffer Receives the data.
+ * @param size Number of bytes to read.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_flash_read(uint32_t addr, uint8_t* pBuffer, uint32_t size);
+
+/**
+ * @name storage_flash_erase
+ * @brief Erases a flash sector, counting the erase against the sector.
+ * 
+ * @param flashSector Index of the sector in flash.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_flash_erase(uint16_t flashSector);
+
+/**
+ * @name storage_time_ns
+ * @brief Monotonic time used to measure flushes.
+ * 
+ * @return The time in nanoseconds.
+ */
+static uint64_t storage_time_ns();
+
+/**
+ * @name storage_flush_chunk_done
+ * @brief Completion of a page program started by storage_flush_async, runs in the I/O context.
+ * 
+ * @param status Result of the page program.
+ * @param pCtx Unused.
+ */
+static void storage_flush_chunk_done(int8_t status, void* pCtx);
+
+/**
+ * @name storage_buffer_load
+ * @brief Makes pTempBuffer mirror a sector, flushing the previous one if needed.
+ * 
+ * @param sectorAddr Start address of the sector to be mirrored.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_buffer_load(uint32_t sectorAddr);
+
+/**
+ * @name storage_append_record
+ * @brief Builds a record right in the buffer of the head sector, starting a new head sector if it does not fit.
+ * 
+ * @param pPayload Payload of the record.
+ * @param payloadLen Length of the payload in bytes, already validated.
+ * @param pEntryAddr Set to the flash address of the record, may be NULL.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t storage_append_record(const void* pPayload, uint32_t payloadLen, uint32_t* pEntryAddr);
 
 //////////////////////////////////////////////////////////////////////
 //                      Public Functions definition
@@ -99,23 +399,17 @@ static uint32_t storage_get_last_entry_addr();
  */
 int8_t storage_init()
 {
-	uint32_t startSector;
-
 	if (-1 == mx25_flash_init())
 	{
 		return -1;
 	}
 
-	entryAddrHead = storage_get_last_entry_addr();
+	// Forget the buffer of a previous session, it is reloaded from flash on the next write
+	bufferSectorAddr = STORAGE_NO_SECTOR;
+	bufferDirtyStart = MX25_FLASH_SECTOR_SIZE;
+	bufferDirtyEnd	 = 0;
 
-	startSector = entryAddrHead / MX25_FLASH_SECTOR_SIZE;
-
-	if (mx25_flash_sector_read(startSector * MX25_FLASH_SECTOR_SIZE, pTempBuffer) != 0)
-	{
-		memset(pTempBuffer, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SECTOR_SIZE);
-	}
-
-	return 0;
+	return storage_locate_log();
 }
 
 /**
@@ -123,169 +417,1288 @@ int8_t storage_init()
  */
 int8_t storage_deInit()
 {
-	return mx25_flash_deInit();
+	int8_t ret = storage_flush();
+
+	bufferSectorAddr = STORAGE_NO_SECTOR;
+
+	if (mx25_flash_deInit() != 0)
+	{
+		return -1;
+	}
+
+	return ret;
 }
 
 /**
  * @brief Buffers an entry to be written to non-volatile memory.
  */
-int8_t storage_store_entry(const void* pPayload, uint32_t payloadLen)
+int8_t storage_store_entry(const void* pPayload, uint32_t payloadLen, uint32_t* pEntryAddr)
 {
-	storage_entry_t entry;
-
-	if (payloadLen > MAX_STORAGE_ENTRY_PAYLOAD_LEN)
+	if (payloadLen == 0 || payloadLen > MAX_STORAGE_ENTRY_PAYLOAD_LEN)
 	{
 		return -1;
 	}
 
-	memset(&entry, 0, sizeof(storage_entry_t));
-
-	entry.header  = ENTRY_HEADER_VALUE;
-	entry.dataLen = payloadLen;
-	memcpy(entry.payloadBuffer, pPayload, payloadLen);
-
-	entry.crc32 = crc_calculate_32(entry.payloadBuffer, payloadLen);
+	// Copies made by the garbage collector are not new data
+	if (!gcRunning)
+	{
+		stats.logicalBytesStored += payloadLen;
+	}
 
-	uint32_t entrySize			= sizeof(storage_entry_t);
-	uint32_t currentSectorNum	= entryAddrHead / MX25_FLASH_SECTOR_SIZE;
-	uint32_t nextEntrySectorNum = (entryAddrHead + entrySize - 1) / MX25_FLASH_SECTOR_SIZE;
+	return storage_append_record(pPayload, payloadLen, pEntryAddr);
+}
 
-	if (nextEntrySectorNum != currentSectorNum)
+/**
+ * @brief Buffers several entries to be written to non-volatile memory by the next flush.
+ */
+int8_t storage_store_entries(const storage_payload_t* pPayloads, uint32_t numPayloads, uint32_t* pEntryAddrs)
+{
+	// Nothing is buffered unless every payload can be stored
+	for (uint32_t i = 0; i < numPayloads; i++)
 	{
-		if (storage_flush() != 0)
+		if (pPayloads[i].payloadLen == 0 || pPayloads[i].payloadLen > MAX_STORAGE_ENTRY_PAYLOAD_LEN)
 		{
 			return -1;
 		}
+	}
 
-		if (mx25_flash_sector_read(nextEntrySectorNum * MX25_FLASH_SECTOR_SIZE, pTempBuffer) != 0)
+	for (uint32_t i = 0; i < numPayloads; i++)
+	{
+		if (storage_append_record(pPayloads[i].pPayload, pPayloads[i].payloadLen, (pEntryAddrs != NULL) ? &pEntryAddrs[i] : NULL) != 0)
 		{
-			memset(pTempBuffer, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SECTOR_SIZE);
+			return -1;
 		}
-	}
 
-	uint32_t offsetInSector = entryAddrHead % MX25_FLASH_SECTOR_SIZE;
-	memcpy(pTempBuffer + offsetInSector, (void*)&entry, entrySize);
-
-	entryAddrHead += entrySize;
+		stats.logicalBytesStored += pPayloads[i].payloadLen;
+	}
 
 	return 0;
 }
 
 /**
- * @brief Retrieves a payload entry from non-volatile memory by its index.
+ * @brief Registers the callbacks used by the garbage collector.
  */
-int8_t storage_retrieve_entry_payload(void* pPayload, uint32_t payloadLen, uint16_t entryNum)
+void storage_set_gc_callbacks(storage_gc_is_live_cb_t isLive, storage_gc_relocated_cb_t relocated, storage_gc_rewrite_cb_t rewrite, void* pCtx)
 {
-	storage_entry_t entry;
-	uint32_t		calculatedCrc;
-	size_t			entrySize = sizeof(storage_entry_t);
+	gcIsLive	= isLive;
+	gcRelocated = relocated;
+	gcRewrite	= rewrite;
+	gcCtx		= pCtx;
+}
 
-	if (mx25_flash_read(entryNum * entrySize, (void*)&entry, entrySize) != 0)
-	{
-		return -1;
-	}
+/**
+ * @brief Retrieves a payload entry from non-volatile memory by its address.
+ */
+int32_t storage_retrieve_entry_payload(void* pPayload, uint32_t payloadLen, uint32_t entryAddr)
+{
+	uint8_t		   record[sizeof(storage_entry_t)];
+	const uint8_t* pStoredPayload;
+	uint32_t	   storedLen;
+	uint32_t	   recordSize;
+	uint32_t	   flashReads = stats.flashReads;
+	int32_t		   ret		  = -1;
+
+	stats.lookups++;
 
-	if (entry.header != ENTRY_HEADER_VALUE)
+	// An address below the log wraps around to a large offset
+	if (entryAddr - FLASH_PAGE_START_ADDRESS > STORAGE_RESERVED_SPACE - STORAGE_RECORD_HEADER_SIZE)
 	{
 		return -1;
 	}
 
-	calculatedCrc = crc_calculate_32(entry.payloadBuffer, entry.dataLen);
-
-	if (calculatedCrc != entry.crc32)
+	if (storage_read(entryAddr, record, STORAGE_RECORD_HEADER_SIZE) == 0)
 	{
-		return -1;
+		recordSize = storage_record_size(record);
+
+		if (recordSize != 0 && entryAddr + recordSize <= FLASH_PAGE_LOG_LAST_ADDRESS && storage_read(entryAddr, record, recordSize) == 0 &&
+			storage_record_payload(record, &pStoredPayload, &storedLen) == 0)
+		{
+			memcpy(pPayload, pStoredPayload, (storedLen < payloadLen) ? storedLen : payloadLen);
+			ret = (int32_t)storedLen;
+		}
 	}
 
-	memcpy(pPayload, entry.payloadBuffer, payloadLen);
+	stats.lookupFlashReads += stats.flashReads - flashReads;
 
-	return 0;
+	return ret;
 }
 
 /**
- * @brief Flushes the temporary buffer to the flash memory.
+ * @brief Starts an iteration at the first entry of the tail sector.
  */
-int8_t storage_flush()
+void storage_iter_init(storage_iter_t* pIter)
+{
+	pIter->sector	  = tailSector;
+	pIter->entryAddr  = storage_sector_addr(tailSector) + STORAGE_SECTOR_HEADER_SIZE;
+	pIter->lastAddr	  = pIter->entryAddr;
+	pIter->windowAddr = pIter->entryAddr;
+	pIter->windowLen  = 0;
+}
+
+/**
+ * @brief Returns the next valid entry, refilling the window from flash when the entry is not fully inside it.
+ */
+int8_t storage_iter_next(storage_iter_t* pIter, const void** ppPayload, uint32_t* pPayloadLen)
 {
-	uint32_t currentSectorAddr = (entryAddrHead / MX25_FLASH_SECTOR_SIZE) * MX25_FLASH_SECTOR_SIZE;
-	uint16_t currentSectorNum  = entryAddrHead / MX25_FLASH_SECTOR_SIZE;
+	const uint8_t* pRecord;
+	const uint8_t* pPayload;
+	uint32_t	   sectorEnd;
+	uint32_t	   recordSize;
 
-	if (mx25_flash_sector_erase(currentSectorNum) != 0)
+	if (activeSectors == 0)
 	{
 		return -1;
 	}
 
-	return mx25_flash_write(currentSectorAddr, pTempBuffer, MX25_FLASH_SECTOR_SIZE);
+	while (1)
+	{
+		sectorEnd = storage_sector_addr(pIter->sector) + MX25_FLASH_SECTOR_SIZE;
+
+		// The window restarts at the record itself, so the record is always read whole
+		if (pIter->entryAddr + STORAGE_RECORD_HEADER_SIZE <= sectorEnd && storage_iter_fill(pIter, STORAGE_RECORD_HEADER_SIZE) == 0)
+		{
+			pRecord	   = &pIter->window[pIter->entryAddr - pIter->windowAddr];
+			recordSize = storage_record_size(pRecord);
+
+			if (recordSize != 0 && pIter->entryAddr + recordSize <= sectorEnd && storage_iter_fill(pIter, recordSize) == 0)
+			{
+				pRecord = &pIter->window[pIter->entryAddr - pIter->windowAddr];
+
+				if (storage_record_payload(pRecord, &pPayload, pPayloadLen) == 0)
+				{
+					*ppPayload = pPayload;
+
+					pIter->lastAddr = pIter->entryAddr;
+					pIter->entryAddr += recordSize;
+
+					return 0;
+				}
+			}
+		}
+
+		// End of the sector: the log ends in the head sector, otherwise it goes on in the next one
+		if (pIter->sector == headSector)
+		{
+			return -1;
+		}
+
+		pIter->sector	 = (pIter->sector + 1) % STORAGE_NUM_SECTORS;
+		pIter->entryAddr = storage_sector_addr(pIter->sector) + STORAGE_SECTOR_HEADER_SIZE;
+	}
 }
 
-// This function should only be used for testing purposes
 /**
- * @brief Resets the internal state of the storage module. For testing only.
+ * @brief Address of the entry returned last by storage_iter_next.
  */
-void _reset_storage_state()
+uint32_t storage_iter_addr(const storage_iter_t* pIter)
 {
-	entryAddrHead = FLASH_PAGE_START_ADDRESS;
-	entryAddrTail = FLASH_PAGE_START_ADDRESS;
+	return pIter->lastAddr;
 }
 
-//////////////////////////////////////////////////////////////////////
-//                         Private Functions definition
-//////////////////////////////////////////////////////////////////////
-
 /**
- * @brief Finds the address of the next available entry slot in flash.
+ * @brief Flushes the temporary buffer to the flash memory.
  */
-static uint32_t storage_get_last_entry_addr()
+int8_t storage_flush()
 {
-	storage_entry_t entry;
-	uint32_t		calculatedCrc;
-	size_t			entrySize = sizeof(storage_entry_t);
-	uint32_t		offset	  = 0;
+	uint64_t startNs = storage_time_ns();
+	int8_t	 ret;
+
+	// Data handed to storage_flush_async is only durable once its page programs are done
+	mx25_flash_wait_idle();
+
+	if (bufferDirtyStart >= bufferDirtyEnd || bufferSectorAddr == STORAGE_NO_SECTOR)
+	{
+		return 0;
+	}
 
-	for (uint16_t i = 0; i < MAP_NUM_ENTRIES; i++)
+	// Only appended bytes are dirty and they are still erased in flash, they are programmed
+	// without erasing the sector
+	ret = storage_program(bufferSectorAddr + bufferDirtyStart, pTempBuffer + bufferDirtyStart, bufferDirtyEnd - bufferDirtyStart);
+
+	if (ret == 0)
 	{
-		offset = i * entrySize;
+		bufferDirtyStart = MX25_FLASH_SECTOR_SIZE;
+		bufferDirtyEnd	 = 0;
+	}
+
+	stats.flushes++;
+	stats.flushTimeNs += storage_time_ns() - startNs;
+
+	return ret;
+}
+
+/**
+ * @brief Starts programming the buffered data and returns without waiting for flash.
+ */
+int8_t storage_flush_async(storage_flush_cb_t pDoneCb, void* pCtx)
+{
+	uint32_t addr;
+	uint32_t end;
+	uint32_t chunkLen;
+
+	// pTempBuffer stays untouched below bufferDirtyEnd, the page programs read it in place
+	mx25_flash_wait_idle();
 
-		if (mx25_flash_read(offset, (void*)&entry, entrySize) != 0)
+	if (bufferDirtyStart >= bufferDirtyEnd || bufferSectorAddr == STORAGE_NO_SECTOR)
+	{
+		if (pDoneCb != NULL)
 		{
-			break;
+			pDoneCb(0, pCtx);
 		}
 
-		if (entry.header != ENTRY_HEADER_VALUE)
+		return 0;
+	}
+
+	addr = bufferSectorAddr + bufferDirtyStart;
+	end	 = bufferSectorAddr + bufferDirtyEnd;
+
+	flushDoneCb		= pDoneCb;
+	flushDoneCtx	= pCtx;
+	flushStatus		= 0;
+	flushChunksLeft = (end - 1) / MX25_FLASH_PAGE_SIZE - addr / MX25_FLASH_PAGE_SIZE + 1;
+
+	// Same split as storage_program, a chunk never crosses a page boundary
+	while (addr < end)
+	{
+		chunkLen = MX25_FLASH_PAGE_SIZE - (addr % MX25_FLASH_PAGE_SIZE);
+		if (chunkLen > end - addr)
 		{
-			break;
+			chunkLen = end - addr;
 		}
 
-		calculatedCrc = crc_calculate_32(entry.payloadBuffer, entry.dataLen);
-
-		if (calculatedCrc != entry.crc32)
+		if (mx25_flash_write_async(addr, pTempBuffer + (addr - bufferSectorAddr), chunkLen, storage_flush_chunk_done, NULL) != 0)
 		{
-			break;
+			// The chunks already queued never bring flushChunksLeft to zero, the range stays dirty
+			mx25_flash_wait_idle();
+			return -1;
 		}
+
+		stats.pagePrograms++;
+		stats.bytesProgrammed += chunkLen;
+		addr += chunkLen;
 	}
 
-	return (FLASH_PAGE_START_ADDRESS + offset);
+	bufferDirtyStart = MX25_FLASH_SECTOR_SIZE;
+	bufferDirtyEnd	 = 0;
+
+	return 0;
 }
 
 /**
- * @brief Calculates the CRC32 checksum for a given data buffer.
+ * @brief Flushes the log and stores a checkpoint taken at the current end of the log.
  */
-static uint32_t crc_calculate_32(const void* data, size_t len)
+int8_t storage_checkpoint_write(const void* pData, uint32_t dataLen)
 {
-	uint32_t	   crc;
-	const uint8_t* buf;
+	storage_checkpoint_header_t header;
+	uint32_t					recordSize = STORAGE_CHECKPOINT_HEADER_SIZE + dataLen + sizeof(uint32_t);
+	uint32_t					crc;
+	uint16_t					sector;
+
+	if (dataLen > STORAGE_CHECKPOINT_MAX_LEN)
+	{
+		return -1;
+	}
+
+	// The checkpoint may only point at entries that are already in flash
+	if (storage_flush() != 0)
+	{
+		return -1;
+	}
+
+	if (activeSectors == 0)
+	{
+		return 0;
+	}
+
+	header.magic	 = STORAGE_CHECKPOINT_MAGIC;
+	header.seq		 = ckptFound ? ckptHeader.seq + 1 : 1;
+	header.logSeq	 = headSeq;
+	header.logAddr	 = entryAddrHead;
+	header.logSector = headSector;
+	header.dataLen	 = (uint16_t)dataLen;
 
-	buf = (const uint8_t*)data;
-	crc = 0xFFFFFFFF;
+	sector = (ckptAddr - STORAGE_CHECKPOINT_FIRST_ADDR) / MX25_FLASH_SECTOR_SIZE;
 
-	for (size_t i = 0; i < len; i++)
+	// Moving to the other sector erases older checkpoints only, the latest one stays where it is
+	if (!ckptFound || ckptNextAddr + recordSize > STORAGE_CHECKPOINT_FIRST_ADDR + (uint32_t)(sector + 1) * MX25_FLASH_SECTOR_SIZE)
 	{
-		crc ^= buf[i];
-		for (int j = 0; j < 8; j++)
+		sector		 = ckptFound ? (sector + 1) % STORAGE_CHECKPOINT_SECTORS : 0;
+		ckptNextAddr = STORAGE_CHECKPOINT_FIRST_ADDR + (uint32_t)sector * MX25_FLASH_SECTOR_SIZE;
+
+		if (storage_flash_erase(ckptNextAddr / MX25_FLASH_SECTOR_SIZE) != 0)
 		{
-			crc = (crc >> 1) ^ (0xEDB88320U & -(int)(crc & 1));
+			return -1;
 		}
 	}
 
-	return ~crc;
+	crc = storage_checkpoint_crc(&header, pData);
+
+	// A checkpoint cut short by a power loss fails its CRC, the previous one is used instead
+	if (storage_program(ckptNextAddr, (const uint8_t*)&header, sizeof(header)) != 0 ||
+		storage_program(ckptNextAddr + STORAGE_CHECKPOINT_HEADER_SIZE, (const uint8_t*)pData, dataLen) != 0 ||
+		storage_program(ckptNextAddr + STORAGE_CHECKPOINT_HEADER_SIZE + dataLen, (const uint8_t*)&crc, sizeof(crc)) != 0)
+	{
+		return -1;
+	}
+
+	ckptFound  = 1;
+	ckptHeader = header;
+	ckptAddr   = ckptNextAddr;
+	ckptNextAddr += recordSize;
+
+	return 0;
+}
+
+/**
+ * @brief Reads the latest checkpoint and starts an iteration right after it.
+ */
+int32_t storage_checkpoint_load(void* pData, uint32_t dataLen, storage_iter_t* pIter)
+{
+	uint32_t seq;
+	uint32_t storedCrc;
+
+	if (!ckptFound || ckptHeader.dataLen > dataLen || activeSectors == 0)
+	{
+		return -1;
+	}
+
+	// Once the sector the checkpoint points into was retired, entries it refers to may be gone
+	if (storage_sector_seq(ckptHeader.logSector, &seq) != 0 || seq != ckptHeader.logSeq)
+	{
+		return -1;
+	}
+
+	if (storage_flash_read(ckptAddr + STORAGE_CHECKPOINT_HEADER_SIZE, (uint8_t*)pData, ckptHeader.dataLen) != 0 ||
+		storage_flash_read(ckptAddr + STORAGE_CHECKPOINT_HEADER_SIZE + ckptHeader.dataLen, (uint8_t*)&storedCrc, sizeof(storedCrc)) != 0)
+	{
+		return -1;
+	}
+
+	if (storage_checkpoint_crc(&ckptHeader, pData) != storedCrc)
+	{
+		stats.crcFailures++;
+		return -1;
+	}
+
+	pIter->sector	  = ckptHeader.logSector;
+	pIter->entryAddr  = ckptHeader.logAddr;
+	pIter->lastAddr	  = pIter->entryAddr;
+	pIter->windowAddr = pIter->entryAddr;
+	pIter->windowLen  = 0;
+
+	return ckptHeader.dataLen;
+}
+
+/**
+ * @brief Copies the I/O and wear counters.
+ */
+void storage_get_stats(storage_stats_t* pStats)
+{
+	if (pStats != NULL)
+	{
+		*pStats = stats;
+	}
+}
+
+/**
+ * @brief Zeroes the I/O and wear counters.
+ */
+void storage_reset_stats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+// This function should only be used for testing purposes
+/**
+ * @brief Resets the internal state of the storage module. For testing only.
+ */
+void _reset_storage_state()
+{
+	// Entries still in the buffer are part of the log, they are found again through storage_read
+	if (storage_locate_log() != 0)
+	{
+		bufferSectorAddr = STORAGE_NO_SECTOR;
+		bufferDirtyStart = MX25_FLASH_SECTOR_SIZE;
+		bufferDirtyEnd	 = 0;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Functions definition
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Finds the address of the next available entry slot in the head sector.
+ */
+static uint32_t storage_get_last_entry_addr(uint32_t startAddr)
+{
+	const void* pPayload;
+	uint32_t	payloadLen;
+	uint32_t	sectorEnd;
+
+	storage_iter_init(&scanIter);
+
+	scanIter.sector	   = headSector;
+	scanIter.entryAddr = startAddr;
+
+	while (storage_iter_next(&scanIter, &pPayload, &payloadLen) == 0)
+	{
+	}
+
+	sectorEnd = storage_sector_addr(headSector) + MX25_FLASH_SECTOR_SIZE;
+
+	for (uint32_t addr = scanIter.entryAddr; addr < sectorEnd; addr += STORAGE_HEAD_SEARCH_CHUNK)
+	{
+		if (!storage_chunk_erased(addr, (sectorEnd - addr < STORAGE_HEAD_SEARCH_CHUNK) ? sectorEnd - addr : STORAGE_HEAD_SEARCH_CHUNK))
+		{
+			return sectorEnd;
+		}
+	}
+
+	return scanIter.entryAddr;
+}
+
+/**
+ * @brief Finds the end of the log in the head sector with a binary search on erased flash.
+ */
+static uint32_t storage_find_head_addr(uint32_t startAddr)
+{
+	uint8_t*	   pTail	 = scanIter.window;
+	uint32_t	   sectorEnd = storage_sector_addr(headSector) + MX25_FLASH_SECTOR_SIZE;
+	uint32_t	   lo		 = 0;
+	uint32_t	   hi		 = (sectorEnd - startAddr + STORAGE_HEAD_SEARCH_CHUNK - 1) / STORAGE_HEAD_SEARCH_CHUNK;
+	uint32_t	   erasedAddr;
+	uint32_t	   tailAddr;
+	uint32_t	   lastUsed;
+	uint32_t	   recordSize;
+	uint32_t	   mid;
+	uint32_t	   size;
+	const uint8_t* pPayload;
+	uint32_t	   payloadLen;
+
+	// First chunk after startAddr that reads as erased, chunks after it are expected to be erased too
+	while (lo < hi)
+	{
+		mid	 = lo + (hi - lo) / 2;
+		size = sectorEnd - (startAddr + mid * STORAGE_HEAD_SEARCH_CHUNK);
+		if (size > STORAGE_HEAD_SEARCH_CHUNK)
+		{
+			size = STORAGE_HEAD_SEARCH_CHUNK;
+		}
+
+		if (storage_chunk_erased(startAddr + mid * STORAGE_HEAD_SEARCH_CHUNK, size))
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+
+	erasedAddr = startAddr + lo * STORAGE_HEAD_SEARCH_CHUNK;
+	if (erasedAddr > sectorEnd)
+	{
+		erasedAddr = sectorEnd;
+	}
+
+	// The last entry ends in the chunk before, read enough to hold the longest entry ending there
+	tailAddr = (erasedAddr - startAddr > STORAGE_RECORD_MAX_SIZE + STORAGE_HEAD_SEARCH_CHUNK) ? erasedAddr - STORAGE_RECORD_MAX_SIZE - STORAGE_HEAD_SEARCH_CHUNK : startAddr;
+	scanIter.windowLen = 0;
+
+	if (erasedAddr == tailAddr)
+	{
+		return startAddr;
+	}
+
+	if (storage_read(tailAddr, pTail, erasedAddr - tailAddr) != 0)
+	{
+		return storage_get_last_entry_addr(startAddr);
+	}
+
+	lastUsed = erasedAddr;
+	while (lastUsed > tailAddr && pTail[lastUsed - 1 - tailAddr] == MX25_FLASH_ERASE_CELL_VAL)
+	{
+		lastUsed--;
+	}
+
+	if (lastUsed == tailAddr && tailAddr == startAddr)
+	{
+		return startAddr;
+	}
+
+	// The end is past the last programmed byte (the CRC may end with erased looking bytes), confirm
+	// it with the walk back: an entry with a valid CRC has to end exactly there
+	for (uint32_t endAddr = lastUsed; endAddr <= erasedAddr; endAddr++)
+	{
+		for (uint32_t addr = endAddr - STORAGE_RECORD_OVERHEAD; addr + STORAGE_RECORD_MAX_SIZE >= endAddr && addr >= tailAddr && addr <= endAddr; addr--)
+		{
+			recordSize = storage_record_size(&pTail[addr - tailAddr]);
+
+			if (recordSize == endAddr - addr && storage_record_payload(&pTail[addr - tailAddr], &pPayload, &payloadLen) == 0)
+			{
+				return endAddr;
+			}
+
+			if (addr == tailAddr)
+			{
+				break;
+			}
+		}
+	}
+
+	return storage_get_last_entry_addr(startAddr);
+}
+
+/**
+ * @brief Checks whether a chunk of the log reads as erased.
+ */
+static uint8_t storage_chunk_erased(uint32_t addr, uint32_t size)
+{
+	uint8_t chunk[STORAGE_HEAD_SEARCH_CHUNK];
+
+	if (storage_read(addr, chunk, size) != 0)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < size; i++)
+	{
+		if (chunk[i] != MX25_FLASH_ERASE_CELL_VAL)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Start address in flash of a log sector.
+ */
+static uint32_t storage_sector_addr(uint16_t sector)
+{
+	return FLASH_PAGE_START_ADDRESS + (uint32_t)sector * MX25_FLASH_SECTOR_SIZE;
+}
+
+/**
+ * @brief Reads and validates the header of a log sector.
+ */
+static int8_t storage_sector_seq(uint16_t sector, uint32_t* pSeq)
+{
+	storage_sector_header_t header;
+
+	if (storage_read(storage_sector_addr(sector), (uint8_t*)&header, sizeof(header)) != 0)
+	{
+		return -1;
+	}
+
+	if (header.magic != STORAGE_SECTOR_MAGIC)
+	{
+		return -1;
+	}
+
+	if (crc32_calculate(&header, offsetof(storage_sector_header_t, crc32)) != header.crc32)
+	{
+		stats.crcFailures++;
+		return -1;
+	}
+
+	*pSeq = header.seq;
+
+	return 0;
+}
+
+/**
+ * @brief Finds the tail and head sectors and the end of the log.
+ */
+static int8_t storage_locate_log()
+{
+	uint32_t seq[STORAGE_NUM_SECTORS];
+	uint8_t	 valid[STORAGE_NUM_SECTORS];
+	uint16_t prev;
+	uint8_t	 record[STORAGE_RECORD_HEADER_SIZE];
+
+	uint32_t startAddr;
+
+	headSector	  = 0;
+	tailSector	  = 0;
+	activeSectors = 0;
+	headSeq		  = 0;
+
+	storage_checkpoint_locate();
+
+	for (uint16_t sector = 0; sector < STORAGE_NUM_SECTORS; sector++)
+	{
+		valid[sector] = (storage_sector_seq(sector, &seq[sector]) == 0);
+
+		if (valid[sector] && (activeSectors == 0 || seq[sector] > headSeq))
+		{
+			headSector	  = sector;
+			headSeq		  = seq[sector];
+			activeSectors = 1;
+		}
+	}
+
+	if (activeSectors == 0)
+	{
+		entryAddrHead = FLASH_PAGE_START_ADDRESS;
+		entryAddrTail = FLASH_PAGE_START_ADDRESS;
+
+		if (storage_read(FLASH_PAGE_START_ADDRESS, record, sizeof(record)) != 0)
+		{
+			return -1;
+		}
+
+		return (storage_record_size(record) != 0) ? storage_migrate_legacy_log() : 0;
+	}
+
+	// Sectors before the tail that are still valid were being retired, they are garbage
+	tailSector = headSector;
+	while (activeSectors < STORAGE_NUM_SECTORS)
+	{
+		prev = (tailSector + STORAGE_NUM_SECTORS - 1) % STORAGE_NUM_SECTORS;
+
+		if (!valid[prev] || seq[prev] != seq[tailSector] - 1)
+		{
+			break;
+		}
+
+		tailSector = prev;
+		activeSectors++;
+	}
+
+	entryAddrTail = storage_sector_addr(tailSector) + STORAGE_SECTOR_HEADER_SIZE;
+
+	// A checkpoint taken in the current head sector saves validating the entries before it
+	startAddr = storage_sector_addr(headSector) + STORAGE_SECTOR_HEADER_SIZE;
+	if (ckptFound && ckptHeader.logSector == headSector && ckptHeader.logSeq == headSeq)
+	{
+		startAddr = ckptHeader.logAddr;
+	}
+
+	entryAddrHead = storage_find_head_addr(startAddr);
+
+	return 0;
+}
+
+/**
+ * @brief Finds the latest valid checkpoint and the address where the next one is appended.
+ */
+static void storage_checkpoint_locate()
+{
+	storage_checkpoint_header_t header;
+	uint8_t*					pSector = scanIter.window;
+	uint32_t					sectorAddr;
+	uint32_t					offset;
+	uint32_t					storedCrc;
+
+	ckptFound		   = 0;
+	ckptNextAddr	   = STORAGE_CHECKPOINT_FIRST_ADDR;
+	scanIter.windowLen = 0;
+
+	for (uint16_t sector = 0; sector < STORAGE_CHECKPOINT_SECTORS; sector++)
+	{
+		sectorAddr = STORAGE_CHECKPOINT_FIRST_ADDR + (uint32_t)sector * MX25_FLASH_SECTOR_SIZE;
+		offset	   = 0;
+
+		if (storage_flash_read(sectorAddr, pSector, MX25_FLASH_SECTOR_SIZE) != 0)
+		{
+			continue;
+		}
+
+		// Checkpoints are appended, the first invalid one ends the sector
+		while (offset + STORAGE_CHECKPOINT_HEADER_SIZE + sizeof(storedCrc) <= MX25_FLASH_SECTOR_SIZE)
+		{
+			memcpy(&header, &pSector[offset], sizeof(header));
+
+			if (header.magic != STORAGE_CHECKPOINT_MAGIC || header.dataLen > STORAGE_CHECKPOINT_MAX_LEN ||
+				offset + STORAGE_CHECKPOINT_HEADER_SIZE + header.dataLen + sizeof(storedCrc) > MX25_FLASH_SECTOR_SIZE)
+			{
+				break;
+			}
+
+			memcpy(&storedCrc, &pSector[offset + STORAGE_CHECKPOINT_HEADER_SIZE + header.dataLen], sizeof(storedCrc));
+
+			if (storage_checkpoint_crc(&header, &pSector[offset + STORAGE_CHECKPOINT_HEADER_SIZE]) != storedCrc)
+			{
+				stats.crcFailures++;
+				break;
+			}
+
+			if (!ckptFound || header.seq > ckptHeader.seq)
+			{
+				ckptFound  = 1;
+				ckptHeader = header;
+				ckptAddr   = sectorAddr + offset;
+				ckptNextAddr = sectorAddr + offset + STORAGE_CHECKPOINT_HEADER_SIZE + header.dataLen + sizeof(storedCrc);
+			}
+
+			offset += STORAGE_CHECKPOINT_HEADER_SIZE + header.dataLen + sizeof(storedCrc);
+		}
+
+		// Nothing can be appended after a checkpoint cut short, the next one goes to the other sector
+		if (ckptFound && ckptAddr >= sectorAddr && ckptAddr < sectorAddr + MX25_FLASH_SECTOR_SIZE)
+		{
+			for (; offset < MX25_FLASH_SECTOR_SIZE; offset++)
+			{
+				if (pSector[offset] != MX25_FLASH_ERASE_CELL_VAL)
+				{
+					ckptNextAddr = sectorAddr + MX25_FLASH_SECTOR_SIZE;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief CRC32 of a checkpoint header and its data.
+ */
+static uint32_t storage_checkpoint_crc(const storage_checkpoint_header_t* pHeader, const void* pData)
+{
+	uint32_t crc = crc32_update(0, pHeader, sizeof(*pHeader));
+
+	return crc32_update(crc, pData, pHeader->dataLen);
+}
+
+/**
+ * @brief Copies the entries of a log written before the sector layout into log sectors.
+ */
+static int8_t storage_migrate_legacy_log()
+{
+	uint8_t		   record[sizeof(storage_entry_t)];
+	const uint8_t* pPayload;
+	uint32_t	   payloadLen;
+	uint32_t	   recordSize;
+	uint32_t	   addr = FLASH_PAGE_START_ADDRESS;
+	int8_t		   ret	= 0;
+
+	// The copy starts right after the old log, without collecting garbage
+	headSector = STORAGE_LEGACY_SECTORS;
+	tailSector = STORAGE_LEGACY_SECTORS;
+	gcRunning  = 1;
+
+	while (addr + STORAGE_RECORD_HEADER_SIZE <= FLASH_PAGE_START_ADDRESS + STORAGE_LEGACY_LOG_SIZE)
+	{
+		if (storage_read(addr, record, STORAGE_RECORD_HEADER_SIZE) != 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		recordSize = storage_record_size(record);
+
+		if (recordSize == 0 || addr + recordSize > FLASH_PAGE_START_ADDRESS + STORAGE_LEGACY_LOG_SIZE)
+		{
+			break;
+		}
+
+		if (storage_read(addr, record, recordSize) != 0 || storage_record_payload(record, &pPayload, &payloadLen) != 0)
+		{
+			break;
+		}
+
+		if (storage_store_entry(pPayload, payloadLen, NULL) != 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		addr += recordSize;
+	}
+
+	gcRunning = 0;
+
+	if (ret != 0 || storage_flush() != 0)
+	{
+		return -1;
+	}
+
+	// The old log is only dropped once its entries are safe in the new sectors
+	for (uint16_t sector = 0; sector < STORAGE_LEGACY_SECTORS; sector++)
+	{
+		if (storage_flash_erase(STORAGE_FIRST_SECTOR + sector) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Starts a new head sector after the current one, collecting garbage first if needed.
+ */
+static int8_t storage_open_head_sector()
+{
+	storage_sector_header_t header;
+	uint32_t				sectorAddr;
+
+	if (activeSectors != 0)
+	{
+		// Every collection retires the tail sector, it frees space unless all its entries are live
+		for (uint16_t attempt = 0; !gcRunning && attempt < STORAGE_NUM_SECTORS && STORAGE_NUM_SECTORS - activeSectors <= STORAGE_GC_RESERVE_SECTORS; attempt++)
+		{
+			if (storage_gc_collect() != 0)
+			{
+				return -1;
+			}
+		}
+
+		// The reserve is only handed out to the collector
+		if (activeSectors == STORAGE_NUM_SECTORS || (!gcRunning && STORAGE_NUM_SECTORS - activeSectors <= STORAGE_GC_RESERVE_SECTORS))
+		{
+			return -1;
+		}
+
+		headSector = (headSector + 1) % STORAGE_NUM_SECTORS;
+	}
+	else
+	{
+		tailSector = headSector;
+	}
+
+	sectorAddr = storage_sector_addr(headSector);
+
+	if (storage_flush() != 0)
+	{
+		return -1;
+	}
+
+	// Recycling a sector is the only time it is erased, whatever it held is discarded
+	bufferSectorAddr = STORAGE_NO_SECTOR;
+
+	if (storage_flash_erase(sectorAddr / MX25_FLASH_SECTOR_SIZE) != 0)
+	{
+		return -1;
+	}
+
+	memset(pTempBuffer, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SECTOR_SIZE);
+	bufferSectorAddr = sectorAddr;
+
+	headSeq++;
+	header.magic = STORAGE_SECTOR_MAGIC;
+	header.seq	 = headSeq;
+	header.crc32 = crc32_calculate(&header, offsetof(storage_sector_header_t, crc32));
+	memcpy(pTempBuffer, &header, sizeof(header));
+	bufferDirtyStart = 0;
+	bufferDirtyEnd	 = sizeof(header);
+
+	activeSectors++;
+	entryAddrHead = sectorAddr + STORAGE_SECTOR_HEADER_SIZE;
+
+	if (activeSectors == 1)
+	{
+		entryAddrTail = entryAddrHead;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Copies the live entries of the tail sector to the head and retires the tail sector.
+ */
+static int8_t storage_gc_collect()
+{
+	uint8_t*	   pSector	  = scanIter.window;
+	uint32_t	   sectorAddr = storage_sector_addr(tailSector);
+	uint32_t	   offset	  = STORAGE_SECTOR_HEADER_SIZE;
+	uint32_t	   recordSize;
+	const uint8_t* pPayload;
+	uint32_t	   payloadLen;
+	uint32_t	   newAddr;
+	uint8_t		   retired[sizeof(uint32_t)] = {0};
+	uint8_t		   rewritten[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+	uint32_t	   rewrittenLen;
+
+	if (activeSectors < 2)
+	{
+		return -1;
+	}
+
+	// The window of the scan iterator is only needed by storage_init
+	scanIter.windowLen = 0;
+
+	if (storage_read(sectorAddr, pSector, MX25_FLASH_SECTOR_SIZE) != 0)
+	{
+		return -1;
+	}
+
+	gcRunning = 1;
+
+	while (offset + STORAGE_RECORD_HEADER_SIZE <= MX25_FLASH_SECTOR_SIZE)
+	{
+		recordSize = storage_record_size(&pSector[offset]);
+
+		if (recordSize == 0 || offset + recordSize > MX25_FLASH_SECTOR_SIZE || storage_record_payload(&pSector[offset], &pPayload, &payloadLen) != 0)
+		{
+			break;
+		}
+
+		if (gcIsLive == NULL || gcIsLive(sectorAddr + offset, pPayload, payloadLen, gcCtx))
+		{
+			rewrittenLen = (gcRewrite != NULL) ? gcRewrite(pPayload, payloadLen, rewritten, gcCtx) : 0;
+			if (rewrittenLen > 0 && rewrittenLen <= MAX_STORAGE_ENTRY_PAYLOAD_LEN)
+			{
+				pPayload   = rewritten;
+				payloadLen = rewrittenLen;
+			}
+
+			if (storage_store_entry(pPayload, payloadLen, &newAddr) != 0)
+			{
+				gcRunning = 0;
+				return -1;
+			}
+
+			stats.gcBytesCopied += payloadLen;
+
+			if (gcRelocated != NULL)
+			{
+				gcRelocated(sectorAddr + offset, newAddr, pPayload, payloadLen, gcCtx);
+			}
+		}
+
+		offset += recordSize;
+	}
+
+	gcRunning = 0;
+
+	// The copies are made durable before the originals are dropped, a power loss in between leaves both
+	if (storage_flush() != 0)
+	{
+		return -1;
+	}
+
+	// Programming the magic to zero retires the sector, it is erased when it becomes the head again
+	if (storage_program(sectorAddr, retired, sizeof(retired)) != 0)
+	{
+		return -1;
+	}
+
+	tailSector = (tailSector + 1) % STORAGE_NUM_SECTORS;
+	activeSectors--;
+	entryAddrTail = storage_sector_addr(tailSector) + STORAGE_SECTOR_HEADER_SIZE;
+	stats.gcRuns++;
+
+	return 0;
+}
+
+/**
+ * @brief Builds a record of the current format around a payload.
+ */
+static uint32_t storage_record_build(uint8_t* pRecord, const void* pPayload, uint32_t payloadLen)
+{
+	storage_record_header_t* pHeader = (storage_record_header_t*)pRecord;
+	uint32_t				 crc;
+
+	pHeader->magic	 = STORAGE_RECORD_MAGIC;
+	pHeader->version = STORAGE_RECORD_VERSION;
+	pHeader->dataLen = (uint8_t)payloadLen;
+	memcpy(pRecord + STORAGE_RECORD_HEADER_SIZE, pPayload, payloadLen);
+
+	crc = crc32_calculate(pRecord, STORAGE_RECORD_HEADER_SIZE + payloadLen);
+	memcpy(pRecord + STORAGE_RECORD_HEADER_SIZE + payloadLen, &crc, sizeof(crc));
+
+	return STORAGE_RECORD_HEADER_SIZE + payloadLen + sizeof(crc);
+}
+
+/**
+ * @brief Size in flash of the record starting with a given header.
+ */
+static uint32_t storage_record_size(const uint8_t* pRecord)
+{
+	storage_record_header_t header;
+	uint32_t				legacyHeader;
+
+	memcpy(&legacyHeader, pRecord, sizeof(legacyHeader));
+
+	if (legacyHeader == ENTRY_HEADER_VALUE)
+	{
+		return sizeof(storage_entry_t);
+	}
+
+	memcpy(&header, pRecord, sizeof(header));
+
+	if (header.magic != STORAGE_RECORD_MAGIC || header.version != STORAGE_RECORD_VERSION || header.dataLen > MAX_STORAGE_ENTRY_PAYLOAD_LEN)
+	{
+		return 0;
+	}
+
+	return header.dataLen + STORAGE_RECORD_OVERHEAD;
+}
+
+/**
+ * @brief Validates a complete record and locates its payload.
+ */
+static int8_t storage_record_payload(const uint8_t* pRecord, const uint8_t** ppPayload, uint32_t* pPayloadLen)
+{
+	storage_entry_t legacyEntry;
+	uint32_t		storedCrc;
+	uint32_t		payloadLen;
+
+	memcpy(&legacyEntry.header, pRecord, sizeof(legacyEntry.header));
+
+	// Format version 1: fixed size, CRC of the payload only
+	if (legacyEntry.header == ENTRY_HEADER_VALUE)
+	{
+		memcpy(&legacyEntry, pRecord, sizeof(legacyEntry));
+
+		if (legacyEntry.dataLen > MAX_STORAGE_ENTRY_PAYLOAD_LEN)
+		{
+			return -1;
+		}
+
+		if (crc32_calculate(legacyEntry.payloadBuffer, legacyEntry.dataLen) != legacyEntry.crc32)
+		{
+			stats.crcFailures++;
+			return -1;
+		}
+
+		*ppPayload	 = ((const storage_entry_t*)pRecord)->payloadBuffer;
+		*pPayloadLen = legacyEntry.dataLen;
+
+		return 0;
+	}
+
+	payloadLen = ((const storage_record_header_t*)pRecord)->dataLen;
+
+	memcpy(&storedCrc, pRecord + STORAGE_RECORD_HEADER_SIZE + payloadLen, sizeof(storedCrc));
+
+	if (crc32_calculate(pRecord, STORAGE_RECORD_HEADER_SIZE + payloadLen) != storedCrc)
+	{
+		stats.crcFailures++;
+		return -1;
+	}
+
+	*ppPayload	 = pRecord + STORAGE_RECORD_HEADER_SIZE;
+	*pPayloadLen = payloadLen;
+
+	return 0;
+}
+
+/**
+ * @brief Makes sure the iterator window holds a number of bytes from its current entry address.
+ */
+static int8_t storage_iter_fill(storage_iter_t* pIter, uint32_t size)
+{
+	uint32_t readLen;
+
+	if (pIter->entryAddr + size > FLASH_PAGE_LOG_LAST_ADDRESS)
+	{
+		return -1;
+	}
+
+	if (pIter->entryAddr >= pIter->windowAddr && pIter->entryAddr + size <= pIter->windowAddr + pIter->windowLen)
+	{
+		return 0;
+	}
+
+	readLen = FLASH_PAGE_LOG_LAST_ADDRESS - pIter->entryAddr;
+	if (readLen > STORAGE_ITER_WINDOW_SIZE)
+	{
+		readLen = STORAGE_ITER_WINDOW_SIZE;
+	}
+
+	if (storage_read(pIter->entryAddr, pIter->window, readLen) != 0)
+	{
+		pIter->windowLen = 0;
+		return -1;
+	}
+
+	pIter->windowAddr = pIter->entryAddr;
+	pIter->windowLen  = readLen;
+
+	return 0;
+}
+
+/**
+ * @brief Reads the log as it would be after a flush.
+ */
+static int8_t storage_read(uint32_t addr, uint8_t* pBuffer, uint32_t size)
+{
+	uint32_t overlapStart;
+	uint32_t overlapEnd;
+
+	if (storage_flash_read(addr, pBuffer, size) != 0)
+	{
+		return -1;
+	}
+
+	if (bufferSectorAddr == STORAGE_NO_SECTOR)
+	{
+		return 0;
+	}
+
+	overlapStart = (addr > bufferSectorAddr) ? addr : bufferSectorAddr;
+	overlapEnd	 = (addr + size < bufferSectorAddr + MX25_FLASH_SECTOR_SIZE) ? addr + size : bufferSectorAddr + MX25_FLASH_SECTOR_SIZE;
+
+	if (overlapStart < overlapEnd)
+	{
+		memcpy(pBuffer + (overlapStart - addr), pTempBuffer + (overlapStart - bufferSectorAddr), overlapEnd - overlapStart);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Programs data into erased flash, split at page boundaries.
+ */
+static int8_t storage_program(uint32_t addr, const uint8_t* pData, uint32_t size)
+{
+	uint32_t chunkLen;
+
+	// A page program wraps around inside its page, a chunk never crosses a page boundary
+	while (size > 0)
+	{
+		chunkLen = MX25_FLASH_PAGE_SIZE - (addr % MX25_FLASH_PAGE_SIZE);
+		if (chunkLen > size)
+		{
+			chunkLen = size;
+		}
+
+		if (mx25_flash_write(addr, (uint8_t*)pData, chunkLen) != 0)
+		{
+			return -1;
+		}
+
+		stats.pagePrograms++;
+		stats.bytesProgrammed += chunkLen;
+
+		addr += chunkLen;
+		pData += chunkLen;
+		size -= chunkLen;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reads from flash and counts the read.
+ */
+static int8_t storage_flash_read(uint32_t addr, uint8_t* pBuffer, uint32_t size)
+{
+	stats.flashReads++;
+	stats.bytesRead += size;
+
+	return mx25_flash_read(addr, pBuffer, size);
+}
+
+/**
+ * @brief Erases a sector and counts the erase against it.
+ */
+static int8_t storage_flash_erase(uint16_t flashSector)
+{
+	// A sector below the log wraps around to a large offset
+	if ((uint16_t)(flashSector - STORAGE_FIRST_SECTOR) < STORAGE_NUM_SECTORS + STORAGE_CHECKPOINT_SECTORS)
+	{
+		stats.sectorErases[flashSector - STORAGE_FIRST_SECTOR]++;
+	}
+
+	return mx25_flash_sector_erase(flashSector);
+}
+
+/**
+ * @brief Reads the monotonic clock.
+ */
+static uint64_t storage_time_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Completion of a page program started by storage_flush_async.
+ */
+static void storage_flush_chunk_done(int8_t status, void* pCtx)
+{
+	(void)pCtx;
+
+	if (status != 0)
+	{
+		flushStatus = -1;
+	}
+
+	if (--flushChunksLeft == 0 && flushDoneCb != NULL)
+	{
+		flushDoneCb(flushStatus, flushDoneCtx);
+	}
+}
+
+/**
+ * @brief Makes pTempBuffer mirror a sector, flushing the previous one if needed.
+ */
+static int8_t storage_buffer_load(uint32_t sectorAddr)
+{
+	if (sectorAddr == bufferSectorAddr)
+	{
+		return 0;
+	}
+
+	if (storage_flush() != 0)
+	{
+		return -1;
+	}
+
+	bufferSectorAddr = STORAGE_NO_SECTOR;
+
+	if (storage_flash_read(sectorAddr, pTempBuffer, MX25_FLASH_SECTOR_SIZE) != 0)
+	{
+		return -1;
+	}
+
+	bufferSectorAddr = sectorAddr;
+
+	return 0;
+}
+
+/**
+ * @brief Builds a record right in the buffer of the head sector.
+ */
+static int8_t storage_append_record(const void* pPayload, uint32_t payloadLen, uint32_t* pEntryAddr)
+{
+	uint32_t recordSize = payloadLen + STORAGE_RECORD_OVERHEAD;
+	uint32_t sectorAddr;
+	uint32_t offset;
+
+	// Records never straddle two sectors, a record not fitting the head sector starts a new one
+	if (activeSectors == 0 || entryAddrHead + recordSize > storage_sector_addr(headSector) + MX25_FLASH_SECTOR_SIZE)
+	{
+		if (storage_open_head_sector() != 0)
+		{
+			return -1;
+		}
+	}
+
+	sectorAddr = storage_sector_addr(headSector);
+
+	if (storage_buffer_load(sectorAddr) != 0)
+	{
+		return -1;
+	}
+
+	// Header, payload and CRC are written in place, the flush programs the whole dirty range at once
+	offset = entryAddrHead - sectorAddr;
+	storage_record_build(pTempBuffer + offset, pPayload, payloadLen);
+
+	if (offset < bufferDirtyStart)
+	{
+		bufferDirtyStart = offset;
+	}
+	if (offset + recordSize > bufferDirtyEnd)
+	{
+		bufferDirtyEnd = offset + recordSize;
+	}
+
+	if (pEntryAddr != NULL)
+	{
+		*pEntryAddr = entryAddrHead;
+	}
+
+	entryAddrHead += recordSize;
+
+	return 0;
 }
\ No newline at end of file
@@ -22,6 +22,42 @@ extern "C" {
 #define MX25_FLASH_BLOCK_SIZE_2 (64 * 1024)		  /// Size of a 64KB flash block in bytes.
 #define MX25_FLASH_PAGE_SIZE 256				  /// Size of a flash page in bytes. This is the maximum amount that can be written in one operation.
 
+//////////////////////////////////////////////////////////////////////
+//                              Types
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Called from the I/O context once an asynchronous operation is done.
+ *        It must not call back into the driver.
+ * 
+ * @param status 0 on success, -1 on failure.
+ * @param pCtx Context given when the operation was started.
+ */
+typedef void (*mx25_flash_done_cb_t)(int8_t status, void* pCtx);
+
+/**
+ * @brief Latency of every device operation, used by the mock to simulate the part.
+ */
+typedef struct mx25_flash_timing
+{
+	uint32_t pageProgramUs;	   /// Page program (tPP)
+	uint32_t sectorEraseUs;	   /// 4 KB sector erase (tSE)
+	uint32_t block32EraseUs;   /// 32 KB block erase (tBE32)
+	uint32_t block64EraseUs;   /// 64 KB block erase (tBE64)
+	uint32_t chipEraseUs;	   /// Chip erase (tCE)
+	uint32_t readSetupNs;	   /// Command, address and dummy cycles of a read
+	uint32_t readNsPerByte;	   /// Clocking out one byte of a read
+} mx25_flash_timing_t;
+
+/**
+ * @brief How the mock spends the latency of an operation.
+ */
+typedef enum mx25_flash_timing_mode
+{
+	MX25_FLASH_TIMING_VIRTUAL, /// Only adds it to the simulated device time
+	MX25_FLASH_TIMING_REAL	   /// Also sleeps for it
+} mx25_flash_timing_mode_t;
+
 //////////////////////////////////////////////////////////////////////
 //                      Public Functions declaration
 //////////////////////////////////////////////////////////////////////
@@ -42,9 +78,25 @@ int8_t mx25_flash_init();
  */
 int8_t mx25_flash_deInit();
 
+/**
+ * @name mx25_flash_use_ram_backend
+ * @brief Keeps the mock flash in a RAM buffer instead of the mock file.
+ * 
+ * @details The RAM contents survive mx25_flash_deInit until the process exits.
+ * 
+ * @param[in] enable 1 for the RAM backend, 0 for the mock file.
+ * 
+ * @retval 0 on success, -1 if the driver is initialized.
+ */
+int8_t mx25_flash_use_ram_backend(uint8_t enable);
+
 /**
  * @name mx25_flash_write
- * @brief Writes data to a specified address in flash.
+ * @brief Writes data to a specified address in flash (page program).
+ * 
+ * @details At most MX25_FLASH_PAGE_SIZE bytes are programmed per operation, data past the
+ *          end of the page wraps around to its start. Callers split larger writes at page
+ *          boundaries.
  * 
  * @param[in] WriteAddr The starting address to write to.
  * @param[in] pBuffer Pointer to the data buffer to write.
@@ -54,6 +106,30 @@ int8_t mx25_flash_deInit();
  */
 int8_t mx25_flash_write(uint32_t WriteAddr, uint8_t* pBuffer, uint32_t size);
 
+/**
+ * @name mx25_flash_write_async
+ * @brief Queues a page program and returns without waiting for it.
+ * 
+ * @details Operations run in order on the I/O context. pBuffer must stay untouched until pDoneCb
+ *          is called. Every other driver call waits for the queued operations first, as the
+ *          device would stay busy until they are done.
+ * 
+ * @param[in] writeAddr The starting address to write to.
+ * @param[in] pBuffer Pointer to the data buffer to write.
+ * @param[in] size Number of bytes to write, within one page like mx25_flash_write.
+ * @param[in] pDoneCb Called with the result of the page program, may be NULL.
+ * @param[in] pCtx Handed to pDoneCb.
+ * 
+ * @retval 0 if the operation was queued, -1 on failure.
+ */
+int8_t mx25_flash_write_async(uint32_t writeAddr, const uint8_t* pBuffer, uint32_t size, mx25_flash_done_cb_t pDoneCb, void* pCtx);
+
+/**
+ * @name mx25_flash_wait_idle
+ * @brief Waits until every queued operation is done and its callback returned.
+ */
+void mx25_flash_wait_idle();
+
 /**
  * @name mx25_flash_read
  * @brief Reads data from a specified address in flash.
@@ -105,6 +181,43 @@ int8_t mx25_flash_sector_erase(uint16_t firstSector);
  */
 int8_t mx25_flash_chip_erase();
 
+/**
+ * @name mx25_flash_get_page_program_count
+ * @brief Number of page program operations (mx25_flash_write calls) since the counter was reset.
+ * 
+ * @return The number of page programs.
+ */
+uint32_t mx25_flash_get_page_program_count();
+
+/**
+ * @name mx25_flash_set_timing
+ * @brief Sets the timing model of the mock.
+ * 
+ * @param[in] mode Whether latencies are only accounted or also slept.
+ * @param[in] pTiming Latencies to use, NULL restores the datasheet defaults.
+ */
+void mx25_flash_set_timing(mx25_flash_timing_mode_t mode, const mx25_flash_timing_t* pTiming);
+
+/**
+ * @name mx25_flash_get_device_time_ns
+ * @brief Simulated time the device spent busy since the clock was reset.
+ * 
+ * @return The simulated device time in nanoseconds.
+ */
+uint64_t mx25_flash_get_device_time_ns();
+
+/**
+ * @name mx25_flash_reset_device_time
+ * @brief Resets the clock returned by mx25_flash_get_device_time_ns.
+ */
+void mx25_flash_reset_device_time();
+
+/**
+ * @name mx25_flash_reset_page_program_count
+ * @brief Resets the counter returned by mx25_flash_get_page_program_count.
+ */
+void mx25_flash_reset_page_program_count();
+
 #ifdef __cplusplus
 }
 #endif
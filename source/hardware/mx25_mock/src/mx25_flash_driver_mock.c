@@ -3,92 +3,288 @@
 //////////////////////////////////////////////////////////////////////
 
 #include "mx25_flash_driver.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 //////////////////////////////////////////////////////////////////////
 //                             Macros
 //////////////////////////////////////////////////////////////////////
 
 #define PATH_TO_MOCK_FILE "../test/mx25_flash_mock/mx25_flash_mock.bin"
+#define MX25_FLASH_NUM_PAGES (MX25_FLASH_SIZE_MEMORY_BYTES / MX25_FLASH_PAGE_SIZE)
+#define MX25_FLASH_ASYNC_QUEUE_LEN 32 /// Page programs queued for the worker thread, enough for a whole sector
+
+/**
+ * Number of times a page may be programmed between two erases of it, override at build
+ * time to match the part (partial page programming cycles).
+ */
+#ifndef MX25_FLASH_MAX_PAGE_PROGRAMS
+#define MX25_FLASH_MAX_PAGE_PROGRAMS 64
+#endif
+
+/**
+ * Default latencies, typical values of the MX25V2035F datasheet (2 Mbit, 104 MHz SPI).
+ * Override at build time to model another part.
+ */
+#ifndef MX25_FLASH_T_PP_US
+#define MX25_FLASH_T_PP_US 500
+#endif
+#ifndef MX25_FLASH_T_SE_US
+#define MX25_FLASH_T_SE_US 30000
+#endif
+#ifndef MX25_FLASH_T_BE32_US
+#define MX25_FLASH_T_BE32_US 150000
+#endif
+#ifndef MX25_FLASH_T_BE64_US
+#define MX25_FLASH_T_BE64_US 300000
+#endif
+#ifndef MX25_FLASH_T_CE_US
+#define MX25_FLASH_T_CE_US 1500000
+#endif
+#ifndef MX25_FLASH_T_READ_SETUP_NS
+#define MX25_FLASH_T_READ_SETUP_NS 385 /// Command, 3 address bytes and a dummy byte at 104 MHz
+#endif
+#ifndef MX25_FLASH_T_READ_NS_PER_BYTE
+#define MX25_FLASH_T_READ_NS_PER_BYTE 77 /// 8 clocks at 104 MHz
+#endif
+
+#define MX25_FLASH_TIMING_DEFAULTS                                                                                   \
+	{MX25_FLASH_T_PP_US, MX25_FLASH_T_SE_US, MX25_FLASH_T_BE32_US, MX25_FLASH_T_BE64_US, MX25_FLASH_T_CE_US, \
+	 MX25_FLASH_T_READ_SETUP_NS, MX25_FLASH_T_READ_NS_PER_BYTE}
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Global Variables
+//////////////////////////////////////////////////////////////////////
+
+static int		mockFileFd = -1;   /// Descriptor of the mock file while the driver is initialized
+static uint8_t* pFlashData = NULL; /// Mock file mapped in memory while the driver is initialized
+static uint8_t* pRamImage  = NULL; /// Contents of the flash with the RAM backend, kept across mx25_flash_deInit
+static uint8_t	useRam	   = 0;	   /// Set when the RAM backend replaces the mock file
+
+static uint8_t	pageProgramCount[MX25_FLASH_NUM_PAGES]; /// Programs of every page since it was last erased
+static uint32_t pageProgramTotal = 0;					 /// Page program operations since the last reset of the counter
+
+static const mx25_flash_timing_t timingDefaults = MX25_FLASH_TIMING_DEFAULTS;		/// Datasheet latencies
+static mx25_flash_timing_t		 timing			= MX25_FLASH_TIMING_DEFAULTS;		/// Latencies in use
+static mx25_flash_timing_mode_t	 timingMode		= MX25_FLASH_TIMING_VIRTUAL;		/// Whether latencies are also slept
+static uint64_t					 deviceTimeNs	= 0;								/// Simulated time the device spent busy
+
+/**
+ * @brief Page program waiting for the worker thread.
+ */
+typedef struct mx25_flash_async_op
+{
+	uint32_t			 writeAddr;
+	const uint8_t*		 pBuffer;
+	uint32_t			 size;
+	mx25_flash_done_cb_t pDoneCb;
+	void*				 pCtx;
+} mx25_flash_async_op_t;
+
+static mx25_flash_async_op_t asyncQueue[MX25_FLASH_ASYNC_QUEUE_LEN];		 /// Operations waiting for the worker thread
+static uint32_t				 asyncHead	  = 0;								 /// Index of the oldest queued operation
+static uint32_t				 asyncCount	  = 0;								 /// Number of queued operations, the running one included
+static uint8_t				 asyncWorker  = 0;								 /// Set while the worker thread runs
+static uint8_t				 asyncStop	  = 0;								 /// Asks the worker thread to exit once idle
+static pthread_t			 asyncThread;									 /// Worker thread simulating the I/O context
+static pthread_mutex_t		 asyncLock	  = PTHREAD_MUTEX_INITIALIZER;		 /// Guards the queue
+static pthread_cond_t		 asyncCond	  = PTHREAD_COND_INITIALIZER;		 /// Signalled whenever the queue changes
+
+//////////////////////////////////////////////////////////////////////
+//                         Private Functions declaration
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @name mx25_flash_erase_range
+ * @brief Sets a range of the mapped mock flash to MX25_FLASH_ERASE_CELL_VAL.
+ * 
+ * @param startAddr First address to erase.
+ * @param size Number of bytes to erase.
+ * 
+ * @retval 0 on success, -1 if the range is outside the flash or the driver is not initialized.
+ */
+static int8_t mx25_flash_erase_range(uint32_t startAddr, uint32_t size);
+
+/**
+ * @name mx25_flash_program
+ * @brief Page program shared by mx25_flash_write and the worker thread.
+ * 
+ * @param writeAddr The starting address to write to.
+ * @param pBuffer Pointer to the data buffer to write.
+ * @param size Number of bytes to write.
+ * 
+ * @retval 0 on success, -1 on failure.
+ */
+static int8_t mx25_flash_program(uint32_t writeAddr, const uint8_t* pBuffer, uint32_t size);
+
+/**
+ * @name mx25_flash_busy
+ * @brief Accounts the latency of an operation, sleeping for it in MX25_FLASH_TIMING_REAL mode.
+ * 
+ * @param latencyNs Latency of the operation in nanoseconds.
+ */
+static void mx25_flash_busy(uint64_t latencyNs);
+
+/**
+ * @name mx25_flash_async_worker
+ * @brief Body of the worker thread, runs queued operations in order.
+ * 
+ * @param pArg Unused.
+ * 
+ * @return NULL.
+ */
+static void* mx25_flash_async_worker(void* pArg);
 
 //////////////////////////////////////////////////////////////////////
 //                      Public Functions definition
 //////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Initializes the mock flash memory, creating the file if it doesn't exist.
+ * @brief Initializes the mock flash memory, creating the file if it doesn't exist,
+ *        and maps it in memory until mx25_flash_deInit.
  */
 int8_t mx25_flash_init(void)
 {
-	FILE*  pFile  = fopen(PATH_TO_MOCK_FILE, "rb");
-	int8_t retVal = 0;
+	off_t fileSize;
 
-	if (pFile == NULL)
+	if (pFlashData != NULL)
 	{
-		pFile = fopen(PATH_TO_MOCK_FILE, "wb");
-		if (pFile == NULL)
-		{
-			return -1;
-		}
+		return 0;
+	}
 
-		uint8_t* pBuff = (uint8_t*)malloc(MX25_FLASH_SIZE_MEMORY_BYTES);
-		if (pBuff == NULL)
+	if (useRam)
+	{
+		if (pRamImage == NULL)
 		{
-			fclose(pFile);
-			return -1;
+			pRamImage = (uint8_t*)malloc(MX25_FLASH_SIZE_MEMORY_BYTES);
+			if (pRamImage == NULL)
+			{
+				return -1;
+			}
+
+			memset(pRamImage, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SIZE_MEMORY_BYTES);
 		}
 
-		memset(pBuff, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SIZE_MEMORY_BYTES);
+		pFlashData = pRamImage;
+		return 0;
+	}
 
-		size_t written = fwrite(pBuff, 1, MX25_FLASH_SIZE_MEMORY_BYTES, pFile);
-		if (written != MX25_FLASH_SIZE_MEMORY_BYTES)
-		{
-			retVal = -1;
-		}
+	mockFileFd = open(PATH_TO_MOCK_FILE, O_RDWR | O_CREAT, 0644);
+	if (mockFileFd < 0)
+	{
+		return -1;
+	}
+
+	fileSize = lseek(mockFileFd, 0, SEEK_END);
 
-		free(pBuff);
+	// New file, size it to the flash and leave every cell erased
+	if (fileSize < MX25_FLASH_SIZE_MEMORY_BYTES && ftruncate(mockFileFd, MX25_FLASH_SIZE_MEMORY_BYTES) != 0)
+	{
+		close(mockFileFd);
+		mockFileFd = -1;
+		return -1;
 	}
 
-	if (pFile)
+	pFlashData = (uint8_t*)mmap(NULL, MX25_FLASH_SIZE_MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, mockFileFd, 0);
+	if (pFlashData == MAP_FAILED)
 	{
-		fclose(pFile);
+		pFlashData = NULL;
+		close(mockFileFd);
+		mockFileFd = -1;
+		return -1;
 	}
 
-	return retVal;
+	if (fileSize < MX25_FLASH_SIZE_MEMORY_BYTES)
+	{
+		memset(pFlashData + fileSize, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SIZE_MEMORY_BYTES - fileSize);
+	}
+
+	return 0;
 }
 
 /**
- * @brief De-initializes the mock flash memory.
+ * @brief De-initializes the mock flash memory, syncing the mapping back to the file.
  */
 int8_t mx25_flash_deInit()
 {
-	return 0;
+	int8_t retVal = 0;
+
+	if (pFlashData == NULL)
+	{
+		return 0;
+	}
+
+	mx25_flash_wait_idle();
+
+	if (asyncWorker)
+	{
+		pthread_mutex_lock(&asyncLock);
+		asyncStop = 1;
+		pthread_cond_broadcast(&asyncCond);
+		pthread_mutex_unlock(&asyncLock);
+
+		pthread_join(asyncThread, NULL);
+		asyncWorker = 0;
+		asyncStop	= 0;
+	}
+
+	if (useRam)
+	{
+		pFlashData = NULL;
+		return 0;
+	}
+
+	if (msync(pFlashData, MX25_FLASH_SIZE_MEMORY_BYTES, MS_SYNC) != 0)
+	{
+		retVal = -1;
+	}
+
+	munmap(pFlashData, MX25_FLASH_SIZE_MEMORY_BYTES);
+	close(mockFileFd);
+
+	pFlashData = NULL;
+	mockFileFd = -1;
+
+	return retVal;
 }
 
 /**
- * @brief Reads data from a specified address in the mock flash.
+ * @brief Selects the RAM backend or the mock file.
  */
-int8_t mx25_flash_read(uint32_t readAddr, uint8_t* pBuffer, uint32_t size)
+int8_t mx25_flash_use_ram_backend(uint8_t enable)
 {
-	if (!pBuffer || (readAddr + size) > MX25_FLASH_SIZE_MEMORY_BYTES)
+	if (pFlashData != NULL)
 	{
 		return -1;
 	}
 
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "rb");
-	if (!pFile)
+	useRam = (enable != 0);
+
+	return 0;
+}
+
+/**
+ * @brief Reads data from a specified address in the mock flash.
+ */
+int8_t mx25_flash_read(uint32_t readAddr, uint8_t* pBuffer, uint32_t size)
+{
+	mx25_flash_wait_idle();
+
+	if (!pBuffer || pFlashData == NULL || (readAddr + size) > MX25_FLASH_SIZE_MEMORY_BYTES)
 	{
 		return -1;
 	}
 
-	fseek(pFile, readAddr, SEEK_SET);
-	size_t read = fread(pBuffer, 1, size, pFile);
-
-	fclose(pFile);
+	mx25_flash_busy(timing.readSetupNs + (uint64_t)timing.readNsPerByte * size);
+	memcpy(pBuffer, pFlashData + readAddr, size);
 
-	return (read == size) ? 0 : -1;
+	return 0;
 }
 
 /**
@@ -102,98 +298,135 @@ int8_t mx25_flash_sector_read(uint32_t readAddr, uint8_t* pBuffer)
 }
 
 /**
- * @brief Writes data to a specified address in the mock flash, simulating NOR flash behavior.
- * 
- * \todo MX25 can only write 256 bytes at at time, mock this behaviour
+ * @brief Programs data into one page of the mock flash, simulating the MX25 page program command.
  */
 int8_t mx25_flash_write(uint32_t writeAddr, uint8_t* pBuffer, uint32_t size)
 {
-	if (!pBuffer || (writeAddr + size) > MX25_FLASH_SIZE_MEMORY_BYTES)
-	{
-		return -1;
-	}
+	mx25_flash_wait_idle();
 
-	// Load full flash into memory
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "rb");
-	if (!pFile)
-	{
-		return -1;
-	}
+	return mx25_flash_program(writeAddr, pBuffer, size);
+}
 
-	uint8_t* flashData = malloc(MX25_FLASH_SIZE_MEMORY_BYTES);
-	if (!flashData)
+/**
+ * @brief Queues a page program for the worker thread.
+ */
+int8_t mx25_flash_write_async(uint32_t writeAddr, const uint8_t* pBuffer, uint32_t size, mx25_flash_done_cb_t pDoneCb, void* pCtx)
+{
+	mx25_flash_async_op_t* pOp;
+
+	if (!pBuffer || pFlashData == NULL || writeAddr >= MX25_FLASH_SIZE_MEMORY_BYTES)
 	{
-		fclose(pFile);
 		return -1;
 	}
 
-	fread(flashData, 1, MX25_FLASH_SIZE_MEMORY_BYTES, pFile);
-	fclose(pFile);
+	pthread_mutex_lock(&asyncLock);
 
-	// Apply write respecting NOR rule: only 1 → 0 transitions allowed
-	for (uint32_t i = 0; i < size; i++)
+	if (!asyncWorker)
 	{
-		uint8_t prev = flashData[writeAddr + i];
-		uint8_t newv = pBuffer[i];
-
-		if ((~prev) & newv)
+		if (pthread_create(&asyncThread, NULL, mx25_flash_async_worker, NULL) != 0)
 		{
-			printf("[MX25 MOCK] Write violation: trying to flip 0->1 at addr 0x%08X\n", writeAddr + i);
-			free(flashData);
+			pthread_mutex_unlock(&asyncLock);
 			return -1;
 		}
 
-		flashData[writeAddr + i] = newv;
+		asyncWorker = 1;
 	}
 
-	// Write entire flash back to file
-	pFile = fopen(PATH_TO_MOCK_FILE, "wb");
-	if (!pFile)
+	// A full queue keeps the caller waiting, as the device would
+	while (asyncCount == MX25_FLASH_ASYNC_QUEUE_LEN)
 	{
-		free(flashData);
-		return -1;
+		pthread_cond_wait(&asyncCond, &asyncLock);
 	}
 
-	fwrite(flashData, 1, MX25_FLASH_SIZE_MEMORY_BYTES, pFile);
-	fclose(pFile);
-	free(flashData);
+	pOp			   = &asyncQueue[(asyncHead + asyncCount) % MX25_FLASH_ASYNC_QUEUE_LEN];
+	pOp->writeAddr = writeAddr;
+	pOp->pBuffer   = pBuffer;
+	pOp->size	   = size;
+	pOp->pDoneCb   = pDoneCb;
+	pOp->pCtx	   = pCtx;
+	asyncCount++;
+
+	pthread_cond_broadcast(&asyncCond);
+	pthread_mutex_unlock(&asyncLock);
 
 	return 0;
 }
 
 /**
- * @brief Erases a specific sector in the mock flash.
+ * @brief Waits until every queued operation is done and its callback returned.
  */
-int8_t mx25_flash_sector_erase(uint16_t firstSector)
+void mx25_flash_wait_idle(void)
 {
-	uint32_t startAddr = firstSector * MX25_FLASH_SECTOR_SIZE;
-	if (startAddr >= MX25_FLASH_SIZE_MEMORY_BYTES)
-	{
-		return -1;
-	}
+	pthread_mutex_lock(&asyncLock);
 
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "rb+");
-	if (!pFile)
+	while (asyncCount > 0)
 	{
-		return -1;
+		pthread_cond_wait(&asyncCond, &asyncLock);
 	}
 
-	uint8_t* eraseBuf = malloc(MX25_FLASH_SECTOR_SIZE);
-	if (!eraseBuf)
-	{
-		fclose(pFile);
-		return -1;
-	}
+	pthread_mutex_unlock(&asyncLock);
+}
 
-	memset(eraseBuf, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SECTOR_SIZE);
+/**
+ * @brief Number of page program operations since the last reset of the counter.
+ */
+uint32_t mx25_flash_get_page_program_count(void)
+{
+	mx25_flash_wait_idle();
 
-	fseek(pFile, startAddr, SEEK_SET);
-	fwrite(eraseBuf, 1, MX25_FLASH_SECTOR_SIZE, pFile);
+	return pageProgramTotal;
+}
 
-	free(eraseBuf);
-	fclose(pFile);
+/**
+ * @brief Resets the counter of page program operations.
+ */
+void mx25_flash_reset_page_program_count(void)
+{
+	mx25_flash_wait_idle();
 
-	return 0;
+	pageProgramTotal = 0;
+}
+
+/**
+ * @brief Sets the timing model of the mock.
+ */
+void mx25_flash_set_timing(mx25_flash_timing_mode_t mode, const mx25_flash_timing_t* pTiming)
+{
+	mx25_flash_wait_idle();
+
+	timingMode = mode;
+	timing	   = (pTiming != NULL) ? *pTiming : timingDefaults;
+}
+
+/**
+ * @brief Simulated time the device spent busy since the clock was reset.
+ */
+uint64_t mx25_flash_get_device_time_ns(void)
+{
+	mx25_flash_wait_idle();
+
+	return deviceTimeNs;
+}
+
+/**
+ * @brief Resets the simulated device clock.
+ */
+void mx25_flash_reset_device_time(void)
+{
+	mx25_flash_wait_idle();
+
+	deviceTimeNs = 0;
+}
+
+/**
+ * @brief Erases a specific sector in the mock flash.
+ */
+int8_t mx25_flash_sector_erase(uint16_t firstSector)
+{
+	mx25_flash_wait_idle();
+	mx25_flash_busy((uint64_t)timing.sectorEraseUs * 1000);
+
+	return mx25_flash_erase_range((uint32_t)firstSector * MX25_FLASH_SECTOR_SIZE, MX25_FLASH_SECTOR_SIZE);
 }
 
 /**
@@ -201,94 +434,201 @@ int8_t mx25_flash_sector_erase(uint16_t firstSector)
  */
 int8_t mx25_flash_block_erase_32k(uint16_t firstBlock)
 {
-	uint32_t startAddr = firstBlock * MX25_FLASH_BLOCK_SIZE_1;
+	mx25_flash_wait_idle();
+	mx25_flash_busy((uint64_t)timing.block32EraseUs * 1000);
+
+	return mx25_flash_erase_range((uint32_t)firstBlock * MX25_FLASH_BLOCK_SIZE_1, MX25_FLASH_BLOCK_SIZE_1);
+}
 
-	if (startAddr >= MX25_FLASH_SIZE_MEMORY_BYTES)
+/**
+ * @brief Erases a 64KB block in the mock flash.
+ */
+int8_t mx25_flash_block_erase_64k(uint16_t firstBlock)
+{
+	mx25_flash_wait_idle();
+	mx25_flash_busy((uint64_t)timing.block64EraseUs * 1000);
+
+	return mx25_flash_erase_range((uint32_t)firstBlock * MX25_FLASH_BLOCK_SIZE_2, MX25_FLASH_BLOCK_SIZE_2);
+}
+
+/**
+ * @brief Erases the entire mock flash chip.
+ * 
+ * @details Can also be called while the driver is not initialized, the file is
+ *          then mapped just for the erase.
+ */
+int8_t mx25_flash_chip_erase(void)
+{
+	int8_t retVal;
+
+	if (pFlashData != NULL)
 	{
-		return -1;
+		mx25_flash_wait_idle();
+		mx25_flash_busy((uint64_t)timing.chipEraseUs * 1000);
+		return mx25_flash_erase_range(0, MX25_FLASH_SIZE_MEMORY_BYTES);
 	}
 
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "rb+");
-	if (!pFile)
+	if (mx25_flash_init() != 0)
 	{
 		return -1;
 	}
 
-	uint8_t* eraseBuf = malloc(MX25_FLASH_BLOCK_SIZE_1);
-	if (!eraseBuf)
+	mx25_flash_busy((uint64_t)timing.chipEraseUs * 1000);
+
+	retVal = mx25_flash_erase_range(0, MX25_FLASH_SIZE_MEMORY_BYTES);
+
+	if (mx25_flash_deInit() != 0)
 	{
-		fclose(pFile);
 		return -1;
 	}
 
-	memset(eraseBuf, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_BLOCK_SIZE_1);
-	fseek(pFile, startAddr, SEEK_SET);
-	fwrite(eraseBuf, 1, MX25_FLASH_BLOCK_SIZE_1, pFile);
+	return retVal;
+}
 
-	free(eraseBuf);
-	fclose(pFile);
+//////////////////////////////////////////////////////////////////////
+//                         Private Functions definition
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Sets a range of the mapped mock flash to MX25_FLASH_ERASE_CELL_VAL.
+ */
+static int8_t mx25_flash_erase_range(uint32_t startAddr, uint32_t size)
+{
+	if (pFlashData == NULL || startAddr >= MX25_FLASH_SIZE_MEMORY_BYTES || (startAddr + size) > MX25_FLASH_SIZE_MEMORY_BYTES)
+	{
+		return -1;
+	}
+
+	memset(pFlashData + startAddr, MX25_FLASH_ERASE_CELL_VAL, size);
+	memset(&pageProgramCount[startAddr / MX25_FLASH_PAGE_SIZE], 0, size / MX25_FLASH_PAGE_SIZE);
 
 	return 0;
 }
 
 /**
- * @brief Erases a 64KB block in the mock flash.
+ * @brief Programs data into one page of the mock flash, simulating the MX25 page program command.
+ * 
+ * @details Like the real device, bytes past the end of the page wrap around to its start
+ *          and only the last MX25_FLASH_PAGE_SIZE bytes sent are kept.
  */
-int8_t mx25_flash_block_erase_64k(uint16_t firstBlock)
+static int8_t mx25_flash_program(uint32_t writeAddr, const uint8_t* pBuffer, uint32_t size)
 {
-	uint32_t startAddr = firstBlock * MX25_FLASH_BLOCK_SIZE_2;
+	uint8_t	 pageLatch[MX25_FLASH_PAGE_SIZE];
+	uint8_t	 latched[MX25_FLASH_PAGE_SIZE];
+	uint32_t pageAddr = writeAddr - (writeAddr % MX25_FLASH_PAGE_SIZE);
+	uint32_t offset;
 
-	if (startAddr >= MX25_FLASH_SIZE_MEMORY_BYTES)
+	if (!pBuffer || pFlashData == NULL || writeAddr >= MX25_FLASH_SIZE_MEMORY_BYTES)
 	{
 		return -1;
 	}
 
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "rb+");
-	if (!pFile)
+	if ((writeAddr % MX25_FLASH_PAGE_SIZE) + size > MX25_FLASH_PAGE_SIZE)
 	{
-		return -1;
+		printf("[MX25 MOCK] Page program of %u bytes at addr 0x%08X wraps around its page\n", size, writeAddr);
 	}
 
-	uint8_t* eraseBuf = malloc(MX25_FLASH_BLOCK_SIZE_2);
-	if (!eraseBuf)
+	if (pageProgramCount[pageAddr / MX25_FLASH_PAGE_SIZE] >= MX25_FLASH_MAX_PAGE_PROGRAMS)
 	{
-		fclose(pFile);
+		printf("[MX25 MOCK] Page at addr 0x%08X programmed %u times without an erase\n", pageAddr, MX25_FLASH_MAX_PAGE_PROGRAMS);
 		return -1;
 	}
 
-	memset(eraseBuf, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_BLOCK_SIZE_2);
-	fseek(pFile, startAddr, SEEK_SET);
-	fwrite(eraseBuf, 1, MX25_FLASH_BLOCK_SIZE_2, pFile);
+	// The device latches the data in a page buffer, the address wraps inside the page
+	memset(latched, 0, sizeof(latched));
+	for (uint32_t i = 0; i < size; i++)
+	{
+		offset			  = (writeAddr + i) % MX25_FLASH_PAGE_SIZE;
+		pageLatch[offset] = pBuffer[i];
+		latched[offset]	  = 1;
+	}
 
-	free(eraseBuf);
-	fclose(pFile);
+	// Check the whole page first, a rejected write leaves the flash untouched
+	for (offset = 0; offset < MX25_FLASH_PAGE_SIZE; offset++)
+	{
+		uint8_t prev = pFlashData[pageAddr + offset];
+
+		// NOR rule: only 1 → 0 transitions allowed
+		if (latched[offset] && ((~prev) & pageLatch[offset]))
+		{
+			printf("[MX25 MOCK] Write violation: trying to flip 0->1 at addr 0x%08X\n", pageAddr + offset);
+			return -1;
+		}
+	}
+
+	for (offset = 0; offset < MX25_FLASH_PAGE_SIZE; offset++)
+	{
+		if (latched[offset])
+		{
+			pFlashData[pageAddr + offset] = pageLatch[offset];
+		}
+	}
+
+	pageProgramCount[pageAddr / MX25_FLASH_PAGE_SIZE]++;
+	pageProgramTotal++;
+	mx25_flash_busy((uint64_t)timing.pageProgramUs * 1000);
 
 	return 0;
 }
 
 /**
- * @brief Erases the entire mock flash chip.
+ * @brief Accounts the latency of an operation, sleeping for it in MX25_FLASH_TIMING_REAL mode.
  */
-int8_t mx25_flash_chip_erase(void)
+static void mx25_flash_busy(uint64_t latencyNs)
 {
-	FILE* pFile = fopen(PATH_TO_MOCK_FILE, "wb");
-	if (!pFile)
+	struct timespec delay;
+
+	deviceTimeNs += latencyNs;
+
+	if (timingMode == MX25_FLASH_TIMING_REAL && latencyNs > 0)
 	{
-		return -1;
+		delay.tv_sec  = (time_t)(latencyNs / 1000000000ULL);
+		delay.tv_nsec = (long)(latencyNs % 1000000000ULL);
+		nanosleep(&delay, NULL);
 	}
+}
+
+/**
+ * @brief Runs queued operations in order, the callback of each one returns before it leaves the queue.
+ */
+static void* mx25_flash_async_worker(void* pArg)
+{
+	mx25_flash_async_op_t op;
+	int8_t				  status;
+
+	(void)pArg;
+
+	pthread_mutex_lock(&asyncLock);
 
-	uint8_t* eraseBuf = malloc(MX25_FLASH_SIZE_MEMORY_BYTES);
-	if (!eraseBuf)
+	for (;;)
 	{
-		fclose(pFile);
-		return -1;
-	}
+		while (asyncCount == 0 && !asyncStop)
+		{
+			pthread_cond_wait(&asyncCond, &asyncLock);
+		}
 
-	memset(eraseBuf, MX25_FLASH_ERASE_CELL_VAL, MX25_FLASH_SIZE_MEMORY_BYTES);
-	fwrite(eraseBuf, 1, MX25_FLASH_SIZE_MEMORY_BYTES, pFile);
+		if (asyncCount == 0)
+		{
+			break;
+		}
 
-	free(eraseBuf);
-	fclose(pFile);
+		op = asyncQueue[asyncHead];
+		pthread_mutex_unlock(&asyncLock);
 
-	return 0;
+		status = mx25_flash_program(op.writeAddr, op.pBuffer, op.size);
+
+		if (op.pDoneCb != NULL)
+		{
+			op.pDoneCb(status, op.pCtx);
+		}
+
+		pthread_mutex_lock(&asyncLock);
+		asyncHead = (asyncHead + 1) % MX25_FLASH_ASYNC_QUEUE_LEN;
+		asyncCount--;
+		pthread_cond_broadcast(&asyncCond);
+	}
+
+	pthread_mutex_unlock(&asyncLock);
+
+	return NULL;
 }
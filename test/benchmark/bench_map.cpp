@@ -0,0 +1,247 @@
+#include "benchmark/benchmark.h"
+#include "crc32.h"
+#include "mx25_flash_driver.h"
+#include "map.h"
+#include "storage.h"
+#include <cstdio>
+#include <vector>
+
+// Every flash benchmark runs once per backend: 0 keeps the flash in RAM, 1 uses the mock file
+enum Backend : int64_t
+{
+    kRam  = 0,
+    kFile = 1,
+};
+
+static void use_backend(benchmark::State& state, int64_t backend)
+{
+    mx25_flash_use_ram_backend(backend == kRam);
+    state.SetLabel(backend == kRam ? "ram" : "file");
+}
+
+// Simulated MX25 busy time per iteration, the host runs the same operations far faster
+static void report_device_time(benchmark::State& state)
+{
+    state.counters["device_us"] = benchmark::Counter(mx25_flash_get_device_time_ns() / 1000.0, benchmark::Counter::kAvgIterations);
+}
+
+// Starts from an erased flash with an empty map
+static void fresh_map(map_entry_log_t* pMapLog)
+{
+    mx25_flash_chip_erase();
+    _reset_storage_state();
+    map_init(pMapLog);
+}
+
+// Writes a log of logLen records spread over a handful of keys, so that
+// most records are superseded versions, as they are on a long running target.
+static void fill_log(int64_t logLen)
+{
+    map_entry_log_t mapLog = {};
+    char            key[MAP_MAX_KEY_LEN];
+
+    fresh_map(&mapLog);
+
+    for (int64_t i = 0; i < logLen; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", (unsigned)(i % 16));
+        map_add_entry_val_u32(key, (uint32_t)i);
+    }
+
+    map_store_all();
+    map_deInit(&mapLog);
+}
+
+// Startup cost (storage scan + log resolution) against the number of records written,
+// the garbage collector keeps the records in flash bounded
+static void BM_MapInit(benchmark::State& state)
+{
+    map_entry_log_t mapLog = {};
+
+    use_backend(state, state.range(1));
+    fill_log(state.range(0));
+    mx25_flash_reset_device_time();
+
+    for (auto _ : state)
+    {
+        _reset_storage_state();
+        map_init(&mapLog);
+        map_deInit(&mapLog);
+    }
+
+    report_device_time(state);
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_MapInit)->ArgsProduct({benchmark::CreateRange(4, 4096, 2), {kRam}})->Complexity();
+BENCHMARK(BM_MapInit)->ArgsProduct({{4, 4096}, {kFile}});
+
+// Put throughput over 64 keys, sector flushes and garbage collection included
+static void BM_MapPut(benchmark::State& state)
+{
+    map_entry_log_t mapLog = {};
+    char            keys[64][MAP_MAX_KEY_LEN];
+    uint32_t        i = 0;
+
+    use_backend(state, state.range(0));
+    for (uint32_t k = 0; k < 64; k++)
+    {
+        snprintf(keys[k], sizeof(keys[k]), "sensor%u", k);
+    }
+
+    fresh_map(&mapLog);
+    mx25_flash_reset_device_time();
+
+    for (auto _ : state)
+    {
+        map_add_entry_val_u32(keys[i % 64], i);
+        i++;
+    }
+
+    report_device_time(state);
+    state.SetItemsProcessed(state.iterations());
+    map_deInit(&mapLog);
+}
+BENCHMARK(BM_MapPut)->Arg(kRam)->Arg(kFile);
+
+// Cost of map_store_all against the number of records appended since the previous flush
+static void BM_MapFlush(benchmark::State& state)
+{
+    map_entry_log_t mapLog = {};
+    char            key[MAP_MAX_KEY_LEN];
+    uint32_t        i = 0;
+
+    use_backend(state, state.range(1));
+    fresh_map(&mapLog);
+    map_store_all();
+    mx25_flash_reset_device_time();
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        for (int64_t n = 0; n < state.range(0); n++, i++)
+        {
+            snprintf(key, sizeof(key), "key%u", i % 32);
+            map_add_entry_val_u32(key, i);
+        }
+        state.ResumeTiming();
+
+        map_store_all();
+    }
+
+    // Includes the page programs of the records, the flush is what makes them durable
+    report_device_time(state);
+    map_deInit(&mapLog);
+}
+BENCHMARK(BM_MapFlush)->ArgsProduct({{1, 8, 32}, {kRam, kFile}});
+
+// Lookups are served from RAM whatever the backend, the map holds its maximum number of keys
+static void BM_MapGetByKey(benchmark::State& state)
+{
+    map_entry_log_t mapLog = {};
+    map_entry_t     entry;
+    char            keys[MAP_MAX_KEYS][MAP_MAX_KEY_LEN];
+    uint32_t        i = 0;
+
+    mx25_flash_use_ram_backend(1);
+    fresh_map(&mapLog);
+    for (uint32_t k = 0; k < MAP_MAX_KEYS; k++)
+    {
+        snprintf(keys[k], sizeof(keys[k]), "config.key%u", k);
+        map_add_entry_val_u32(keys[k], k);
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(map_get_entry_via_key(&mapLog, keys[i++ % MAP_MAX_KEYS], &entry));
+    }
+
+    map_deInit(&mapLog);
+}
+BENCHMARK(BM_MapGetByKey);
+
+// Lookup by position indexes the arrays of the map, its cost does not depend on the position
+static void BM_MapGetByNum(benchmark::State& state)
+{
+    map_entry_log_t mapLog = {};
+    map_entry_t     entry;
+    char            key[MAP_MAX_KEY_LEN];
+
+    mx25_flash_use_ram_backend(1);
+    fresh_map(&mapLog);
+    for (uint32_t k = 0; k < MAP_MAX_KEYS; k++)
+    {
+        snprintf(key, sizeof(key), "config.key%u", k);
+        map_add_entry_val_u32(key, k);
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(map_get_entry_via_num(&mapLog, (uint16_t)state.range(0), &entry));
+    }
+
+    state.SetComplexityN(state.range(0) + 1);
+    map_deInit(&mapLog);
+}
+BENCHMARK(BM_MapGetByNum)->Arg(0)->Arg(31)->Arg(63)->Arg(MAP_MAX_KEYS - 1)->Complexity(benchmark::o1);
+
+// Walk over every key, the cursor way versus one map_get_entry_via_num call per key
+static void BM_MapIterate(benchmark::State& state)
+{
+    map_entry_log_t         mapLog = {};
+    map_entry_t             entry;
+    map_iter_t              iter;
+    const map_entry_view_t* pEntry;
+    char                    key[MAP_MAX_KEY_LEN];
+
+    mx25_flash_use_ram_backend(1);
+    fresh_map(&mapLog);
+    for (uint32_t k = 0; k < (uint32_t)state.range(1); k++)
+    {
+        snprintf(key, sizeof(key), "config.key%u", k);
+        map_add_entry_val_u32(key, k);
+    }
+
+    for (auto _ : state)
+    {
+        if (state.range(0) == 0)
+        {
+            map_iter_begin(&mapLog, &iter);
+            while ((pEntry = map_iter_next(&iter)) != NULL)
+            {
+                benchmark::DoNotOptimize(pEntry);
+            }
+            map_iter_end(&iter);
+        }
+        else
+        {
+            for (uint16_t n = 0; map_get_entry_via_num(&mapLog, n, &entry) == 0; n++)
+            {
+                benchmark::DoNotOptimize(entry);
+            }
+        }
+    }
+
+    state.SetLabel(state.range(0) == 0 ? "iterator" : "via_num");
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+    map_deInit(&mapLog);
+}
+BENCHMARK(BM_MapIterate)->ArgsProduct({{0, 1}, {16, MAP_MAX_KEYS}});
+
+
+// CRC throughput of each implementation, 102 bytes is a full entry payload
+template <uint32_t (*crcFunction)(const void*, size_t)>
+static void BM_Crc32(benchmark::State& state)
+{
+    std::vector<uint8_t> data(state.range(0), 0xA5);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(crcFunction(data.data(), data.size()));
+    }
+
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(crcFunction == crc32_calculate ? crc32_implementation() : "");
+}
+BENCHMARK_TEMPLATE(BM_Crc32, crc32_calculate_bitwise)->Arg(102)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_Crc32, crc32_calculate_sliced)->Arg(102)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_Crc32, crc32_calculate)->Arg(102)->Arg(4096);
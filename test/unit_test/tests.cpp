@@ -1,4 +1,5 @@
 #include "gtest/gtest.h"
+#include "crc32.h"
 #include "mx25_flash_driver.h"
 #include "map.h"
 #include "storage.h"
@@ -6,6 +7,9 @@
 #include <vector>
 #include <string>
 #include <cstdio> 
+#include <cstring>
+#include <atomic>
+#include <thread>
  
 // Test fixture for map tests
 class MapTest : public ::testing::Test {
@@ -78,4 +82,930 @@ TEST_F(MapTest, AddAndRetrieveMultipleOverwrittenEntries)
     ASSERT_EQ(0, map_get_entry_via_num(&rtosComponents, 2, &entry));
     EXPECT_STREQ("rtos", entry.key);
     EXPECT_STREQ("nuttX", entry.valueStr);
-}
\ No newline at end of file
+}
+
+TEST_F(MapTest, GetEntryViaKeyReturnsLatestEntry)
+{
+    ASSERT_EQ(0, map_add_entry_val_str("task1Name", "network"));
+    ASSERT_EQ(0, map_add_entry_val_u32("timeout", 1234));
+    ASSERT_EQ(0, map_add_entry_val_str("task1Name", "sensors"));
+
+    map_entry_t entry;
+
+    // The add path keeps the key index up to date
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "task1Name", &entry));
+    EXPECT_STREQ("sensors", entry.valueStr);
+
+    ASSERT_EQ(0, map_store_all());
+
+    _reset_storage_state();
+    map_read_log(&rtosComponents);
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "task1Name", &entry));
+    EXPECT_STREQ("sensors", entry.valueStr);
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "timeout", &entry));
+    EXPECT_EQ(1234, entry.valueU32);
+
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "missing", &entry));
+}
+
+TEST_F(MapTest, IteratorYieldsLatestLiveEntriesInOrder)
+{
+    map_iter_t              iter;
+    const map_entry_view_t* pEntry;
+    map_entry_log_t         otherLog = {};
+    std::vector<std::string> keys;
+
+    ASSERT_EQ(0, map_add_entry_val_u32("a", 1));
+    ASSERT_EQ(0, map_add_entry_val_str("b", "old"));
+    ASSERT_EQ(0, map_add_entry_val_u32("c", 3));
+    ASSERT_EQ(0, map_add_entry_val_str("b", "new"));
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "a"));
+
+    ASSERT_EQ(0, map_iter_begin(&rtosComponents, &iter));
+    while ((pEntry = map_iter_next(&iter)) != NULL)
+    {
+        keys.push_back(pEntry->key);
+        if (keys.back() == "b")
+        {
+            EXPECT_STREQ("new", pEntry->valueStr);
+        }
+    }
+    EXPECT_EQ(nullptr, map_iter_next(&iter));
+    map_iter_end(&iter);
+
+    EXPECT_EQ((std::vector<std::string>{"b", "c"}), keys);
+
+#ifndef MAP_LAZY_VALUES
+    // Views point into the map rather than into copies, a second walk yields the same key
+    const char* pFirstKey;
+    ASSERT_EQ(0, map_iter_begin(&rtosComponents, &iter));
+    pFirstKey = map_iter_next(&iter)->key;
+    map_iter_end(&iter);
+    ASSERT_EQ(0, map_iter_begin(&rtosComponents, &iter));
+    EXPECT_EQ(pFirstKey, map_iter_next(&iter)->key);
+    map_iter_end(&iter);
+#endif
+
+    // Writers may run again once the walk is over
+    ASSERT_EQ(0, map_add_entry_val_u32("d", 4));
+    EXPECT_EQ(-1, map_iter_begin(&otherLog, &iter));
+
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "b"));
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "c"));
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "d"));
+    ASSERT_EQ(0, map_iter_begin(&rtosComponents, &iter));
+    EXPECT_EQ(nullptr, map_iter_next(&iter));
+    map_iter_end(&iter);
+}
+
+TEST_F(MapTest, DeletedKeysStayDeletedAndAreReclaimed)
+{
+    storage_stats_t stats;
+    map_entry_t     entry;
+    char            key[MAP_MAX_KEY_LEN];
+
+    ASSERT_EQ(0, map_add_entry_val_str("first", "a"));
+    ASSERT_EQ(0, map_add_entry_val_u32("second", 2));
+    ASSERT_EQ(0, map_add_entry_val_u32("third", 3));
+    ASSERT_EQ(0, map_store_all());
+
+    // A delete is a single small record, appended without erasing anything
+    storage_reset_stats();
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "first"));
+    ASSERT_EQ(0, storage_flush());
+    storage_get_stats(&stats);
+    EXPECT_EQ(1u, stats.pagePrograms);
+    EXPECT_EQ(0u, stats.sectorErases[0]);
+
+    EXPECT_EQ(-1, map_delete_entry(&rtosComponents, "first"));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "first", &entry));
+    ASSERT_EQ(0, map_get_entry_via_num(&rtosComponents, 0, &entry));
+    EXPECT_STREQ("second", entry.key);
+    EXPECT_EQ(-1, map_get_entry_via_num(&rtosComponents, 2, &entry));
+
+    // Tombstones are honoured by a full scan of the log and by checkpoints alike
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "third"));
+    ASSERT_EQ(0, map_store_all());
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "first", &entry));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "third", &entry));
+
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "first", &entry));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "second", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+
+    // A deleted key comes back when it is added again
+    ASSERT_EQ(0, map_add_entry_val_u32("first", 11));
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "second"));
+    ASSERT_EQ(0, map_get_entry_via_num(&rtosComponents, 0, &entry));
+    EXPECT_STREQ("first", entry.key);
+    EXPECT_EQ(11u, entry.valueU32);
+
+    // Keys freed by deletes are reused, tombstones and deleted values are collected
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        snprintf(key, sizeof(key), "temp%u", i % (MAP_MAX_KEYS - 1));
+        ASSERT_EQ(0, map_add_entry_val_u32(key, i)) << i;
+        ASSERT_EQ(0, map_delete_entry(&rtosComponents, key)) << i;
+    }
+
+    ASSERT_EQ(0, map_store_all());
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "temp0", &entry));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "second", &entry));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "first", &entry));
+    EXPECT_EQ(11u, entry.valueU32);
+    EXPECT_EQ(-1, map_get_entry_via_num(&rtosComponents, 1, &entry));
+}
+
+TEST_F(MapTest, TransactionsApplyOnlyOnceCommitted)
+{
+    map_entry_t entry;
+
+    ASSERT_EQ(0, map_add_entry_val_u32("mode", 1));
+
+    // Committed: both keys change together
+    ASSERT_EQ(0, map_tx_begin());
+    EXPECT_EQ(-1, map_tx_begin());
+    ASSERT_EQ(0, map_add_entry_val_u32("mode", 2));
+    ASSERT_EQ(0, map_add_entry_val_str("name", "pump"));
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "name", &entry));
+    ASSERT_EQ(0, map_tx_commit());
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "name", &entry));
+    EXPECT_STREQ("pump", entry.valueStr);
+
+    // Aborted: nothing changes
+    ASSERT_EQ(0, map_tx_begin());
+    ASSERT_EQ(0, map_add_entry_val_u32("mode", 3));
+    ASSERT_EQ(0, map_tx_abort());
+    EXPECT_EQ(-1, map_tx_abort());
+
+    // Left open across a power loss: ignored on the next read
+    ASSERT_EQ(0, map_tx_begin());
+    ASSERT_EQ(0, map_add_entry_val_u32("mode", 4));
+    ASSERT_EQ(0, map_add_entry_val_str("name", "fan"));
+    ASSERT_EQ(0, storage_flush());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "mode", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "name", &entry));
+    EXPECT_STREQ("pump", entry.valueStr);
+
+    // Committed transactions survive garbage collection of their commit markers
+    for (uint32_t i = 0; i < 2000; i++)
+    {
+        ASSERT_EQ(0, map_tx_begin());
+        ASSERT_EQ(0, map_add_entry_val_u32("mode", i));
+        ASSERT_EQ(0, map_add_entry_val_u32("mode", i + 1));
+        ASSERT_EQ(0, map_add_entry_val_u32("count", i));
+        ASSERT_EQ(0, map_tx_commit()) << i;
+    }
+
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "mode", &entry));
+    EXPECT_EQ(2000u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "count", &entry));
+    EXPECT_EQ(1999u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "name", &entry));
+    EXPECT_STREQ("pump", entry.valueStr);
+}
+
+struct FlushDone
+{
+    std::atomic<int>         calls{0};
+    std::atomic<int>         status{1};
+    std::thread::id          thread;
+};
+
+static void onFlushDone(int8_t status, void* pCtx)
+{
+    FlushDone* pDone = static_cast<FlushDone*>(pCtx);
+
+    pDone->thread = std::this_thread::get_id();
+    pDone->status = status;
+    pDone->calls++;
+}
+
+TEST_F(MapTest, AsyncFlushCallsBackOnceDurable)
+{
+    FlushDone      done;
+    map_entry_t    entry;
+    uint8_t        checkpoint[STORAGE_CHECKPOINT_MAX_LEN];
+    storage_iter_t iter;
+
+    // A fresh map owes a checkpoint, the flush stays asynchronous and leaves it for later
+    for (uint32_t i = 0; i < 40; i++)
+    {
+        ASSERT_EQ(0, map_add_entry_val_u32(("sensor" + std::to_string(i)).c_str(), i));
+    }
+
+    ASSERT_EQ(0, map_store_all_async(onFlushDone, &done));
+
+    // Entries added while the flush is in flight go into the next one
+    ASSERT_EQ(0, map_add_entry_val_str("late", "entry"));
+
+    // storage_flush waits for the page programs in flight
+    ASSERT_EQ(0, storage_flush());
+    EXPECT_EQ(1, done.calls.load());
+    EXPECT_EQ(0, done.status.load());
+    EXPECT_NE(std::this_thread::get_id(), done.thread);
+    EXPECT_EQ(-1, storage_checkpoint_load(checkpoint, sizeof(checkpoint), &iter));
+
+    // Nothing buffered, the callback runs right away
+    ASSERT_EQ(0, map_store_all_async(onFlushDone, &done));
+    EXPECT_EQ(2, done.calls.load());
+
+    ASSERT_EQ(0, map_store_all());
+    EXPECT_LE(0, storage_checkpoint_load(checkpoint, sizeof(checkpoint), &iter));
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "sensor39", &entry));
+    EXPECT_EQ(39u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "late", &entry));
+    EXPECT_STREQ("entry", entry.valueStr);
+}
+
+#ifdef MAP_THREAD_SAFE
+TEST_F(MapTest, ReadersRunAlongsideTheWriter)
+{
+    std::atomic<bool>     done(false);
+    std::atomic<uint32_t> badReads(0);
+    std::vector<std::thread> readers;
+
+    // Every key holds a counter and a string that always agrees with it
+    ASSERT_EQ(0, map_add_entry_val_u32("counter", 0));
+    ASSERT_EQ(0, map_add_entry_val_str("label", "0"));
+
+    for (int r = 0; r < 4; r++)
+    {
+        readers.emplace_back([&]() {
+            map_entry_t entry;
+            uint32_t    lastCounter = 0;
+
+            while (!done)
+            {
+                if (0 != map_get_entry_via_key(&rtosComponents, "counter", &entry) || entry.valueU32 < lastCounter)
+                {
+                    badReads++;
+                    continue;
+                }
+                lastCounter = entry.valueU32;
+                std::this_thread::yield();
+
+                if (0 != map_get_entry_via_key(&rtosComponents, "label", &entry) || entry.valueStr[0] == '\0')
+                {
+                    badReads++;
+                }
+            }
+        });
+    }
+
+    for (uint32_t i = 1; i <= 3000; i++)
+    {
+        ASSERT_EQ(0, map_add_entry_val_u32("counter", i));
+        ASSERT_EQ(0, map_add_entry_val_str("label", std::to_string(i).c_str()));
+        ASSERT_EQ(0, map_store_all());
+    }
+
+    done = true;
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
+
+    EXPECT_EQ(0u, badReads.load());
+
+    map_entry_t entry;
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "counter", &entry));
+    EXPECT_EQ(3000u, entry.valueU32);
+}
+
+TEST_F(MapTest, FlusherThreadStoresQueuedEntries)
+{
+    std::vector<std::thread> producers;
+    map_entry_t              entry;
+
+    ASSERT_EQ(0, map_async_start());
+    EXPECT_EQ(-1, map_async_start());
+    EXPECT_EQ(-1, map_tx_begin());
+
+    for (int p = 0; p < 4; p++)
+    {
+        producers.emplace_back([p]() {
+            std::string key = "producer" + std::to_string(p);
+
+            for (uint32_t i = 0; i < 500; i++)
+            {
+                // A full queue is reported rather than waited for
+                while (0 != map_add_entry_val_u32(key.c_str(), i))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+
+    ASSERT_EQ(0, map_add_entry_val_str("last", "done"));
+    ASSERT_EQ(0, map_sync());
+
+    for (int p = 0; p < 4; p++)
+    {
+        ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, ("producer" + std::to_string(p)).c_str(), &entry));
+        EXPECT_EQ(499u, entry.valueU32);
+    }
+
+    // The tombstone of a key that was never added is accepted, then dropped by the flusher thread
+    storage_stats_t before, after;
+    storage_get_stats(&before);
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "ghost"));
+    ASSERT_EQ(0, map_sync());
+    storage_get_stats(&after);
+    EXPECT_EQ(before.logicalBytesStored, after.logicalBytesStored);
+
+    // Queued after the barrier, stored by map_async_stop
+    ASSERT_EQ(0, map_add_entry_val_u32("producer0", 1000));
+    ASSERT_EQ(0, map_async_stop());
+    EXPECT_EQ(-1, map_async_stop());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "producer0", &entry));
+    EXPECT_EQ(1000u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "last", &entry));
+    EXPECT_STREQ("done", entry.valueStr);
+}
+#endif
+
+
+TEST(Crc32Test, MatchesBitwiseReference)
+{
+    std::vector<uint8_t> data(4096 + 7);
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (uint8_t)(i * 131 + (i >> 3));
+    }
+
+    EXPECT_EQ(0xCBF43926U, crc32_calculate("123456789", 9));
+
+    for (size_t len = 0; len <= 300; len++)
+    {
+        for (size_t offset = 0; offset < 8; offset++)
+        {
+            uint32_t expected = crc32_calculate_bitwise(&data[offset], len);
+
+            ASSERT_EQ(expected, crc32_calculate(&data[offset], len)) << "len " << len << " offset " << offset;
+            ASSERT_EQ(expected, crc32_calculate_sliced(&data[offset], len)) << "len " << len << " offset " << offset;
+        }
+    }
+
+    EXPECT_EQ(crc32_calculate_bitwise(data.data(), 4096), crc32_update(crc32_calculate(data.data(), 1000), &data[1000], 3096));
+}
+
+TEST(FlashMockTest, PersistsAcrossInitAndEnforcesNorWrites)
+{
+    uint8_t pattern[4] = {0x12, 0x34, 0x56, 0x78};
+    uint8_t readBack[4];
+    uint8_t allOnes[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+
+    ASSERT_EQ(0, mx25_flash_chip_erase());
+    ASSERT_EQ(0, mx25_flash_init());
+    ASSERT_EQ(0, mx25_flash_write(0x1000, pattern, sizeof(pattern)));
+
+    // 0 -> 1 transitions need an erase
+    EXPECT_EQ(-1, mx25_flash_write(0x1000, allOnes, sizeof(allOnes)));
+    ASSERT_EQ(0, mx25_flash_deInit());
+
+    ASSERT_EQ(0, mx25_flash_init());
+    ASSERT_EQ(0, mx25_flash_read(0x1000, readBack, sizeof(readBack)));
+    EXPECT_EQ(0, memcmp(pattern, readBack, sizeof(pattern)));
+
+    ASSERT_EQ(0, mx25_flash_sector_erase(1));
+    ASSERT_EQ(0, mx25_flash_read(0x1000, readBack, sizeof(readBack)));
+    EXPECT_EQ(0, memcmp(allOnes, readBack, sizeof(allOnes)));
+    ASSERT_EQ(0, mx25_flash_deInit());
+}
+
+
+TEST(FlashMockTest, PageProgramWrapsAroundAndIsCounted)
+{
+    std::vector<uint8_t> data(MX25_FLASH_PAGE_SIZE + 16);
+    std::vector<uint8_t> readBack(MX25_FLASH_PAGE_SIZE);
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (uint8_t)i;
+    }
+
+    ASSERT_EQ(0, mx25_flash_chip_erase());
+    ASSERT_EQ(0, mx25_flash_init());
+    mx25_flash_reset_page_program_count();
+
+    // Starting 16 bytes before the end of the page, the rest wraps to the start of the same page
+    ASSERT_EQ(0, mx25_flash_write(MX25_FLASH_PAGE_SIZE - 16, data.data(), 32));
+    ASSERT_EQ(0, mx25_flash_read(0, readBack.data(), MX25_FLASH_PAGE_SIZE));
+    EXPECT_EQ(0, memcmp(&data[16], &readBack[0], 16));
+    EXPECT_EQ(0, memcmp(&data[0], &readBack[MX25_FLASH_PAGE_SIZE - 16], 16));
+    EXPECT_EQ(0xFF, readBack[16]);
+    EXPECT_EQ(1u, mx25_flash_get_page_program_count());
+
+    // Only the last page worth of bytes sent is programmed
+    ASSERT_EQ(0, mx25_flash_sector_erase(0));
+    ASSERT_EQ(0, mx25_flash_write(0, data.data(), data.size()));
+    ASSERT_EQ(0, mx25_flash_read(0, readBack.data(), MX25_FLASH_PAGE_SIZE));
+    EXPECT_EQ(0, memcmp(&data[MX25_FLASH_PAGE_SIZE], &readBack[0], 16));
+    EXPECT_EQ(0, memcmp(&data[16], &readBack[16], MX25_FLASH_PAGE_SIZE - 16));
+    ASSERT_EQ(0, mx25_flash_read(MX25_FLASH_PAGE_SIZE, readBack.data(), 1));
+    EXPECT_EQ(0xFF, readBack[0]);
+    EXPECT_EQ(2u, mx25_flash_get_page_program_count());
+
+    ASSERT_EQ(0, mx25_flash_deInit());
+}
+
+TEST(FlashMockTest, VirtualClockAccumulatesDeviceTime)
+{
+    const mx25_flash_timing_t timing = {100, 2000, 0, 0, 0, 50, 10};
+    std::vector<uint8_t>      data(64, 0x5A);
+
+    ASSERT_EQ(0, mx25_flash_chip_erase());
+    ASSERT_EQ(0, mx25_flash_init());
+    mx25_flash_set_timing(MX25_FLASH_TIMING_VIRTUAL, &timing);
+    mx25_flash_reset_device_time();
+
+    ASSERT_EQ(0, mx25_flash_sector_erase(1));
+    ASSERT_EQ(0, mx25_flash_write(MX25_FLASH_SECTOR_SIZE, data.data(), data.size()));
+    ASSERT_EQ(0, mx25_flash_write_async(MX25_FLASH_SECTOR_SIZE + 64, data.data(), data.size(), NULL, NULL));
+    ASSERT_EQ(0, mx25_flash_read(MX25_FLASH_SECTOR_SIZE, data.data(), 32));
+
+    // Erase, two page programs and a 32 byte read, nothing was slept
+    EXPECT_EQ(2000000u + 2 * 100000u + 50u + 32 * 10u, mx25_flash_get_device_time_ns());
+
+    mx25_flash_set_timing(MX25_FLASH_TIMING_VIRTUAL, NULL);
+    ASSERT_EQ(0, mx25_flash_deInit());
+}
+
+
+TEST_F(MapTest, EntriesStraddlingSectorsSurviveReinit)
+{
+    char key[MAP_MAX_KEY_LEN];
+
+    // Enough entries to fill the first sector and straddle into the second one
+    for (uint32_t i = 0; i < 60; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, i));
+    }
+
+    ASSERT_EQ(0, map_store_all());
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    map_entry_t entry;
+
+    for (uint32_t i = 0; i < 60; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i);
+        ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, key, &entry)) << key;
+        EXPECT_EQ(i, entry.valueU32);
+    }
+}
+
+
+TEST_F(MapTest, ReadsLegacyFixedSizeEntries)
+{
+    // Layout of the entries written by the first record format version
+    struct __attribute__((__packed__))
+    {
+        uint32_t header;
+        uint8_t  payloadBuffer[MAX_STORAGE_ENTRY_PAYLOAD_LEN];
+        uint32_t dataLen;
+        uint32_t crc32;
+    } legacyEntry;
+    map_entry_t payload = {};
+
+    payload.type     = 1;
+    payload.valueU32 = 42;
+    strcpy(payload.key, "legacy");
+
+    memset(&legacyEntry, 0, sizeof(legacyEntry));
+    legacyEntry.header  = 0xDEADBEEF;
+    legacyEntry.dataLen = sizeof(payload);
+    memcpy(legacyEntry.payloadBuffer, &payload, sizeof(payload));
+    legacyEntry.crc32 = crc32_calculate(legacyEntry.payloadBuffer, sizeof(payload));
+
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, mx25_flash_init());
+    ASSERT_EQ(0, mx25_flash_write(0, (uint8_t*)&legacyEntry, sizeof(legacyEntry)));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    // New entries are appended in the compact format after the legacy one
+    ASSERT_EQ(0, map_add_entry_val_str("fresh", "compact"));
+    ASSERT_EQ(0, map_store_all());
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    map_entry_t entry;
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "legacy", &entry));
+    EXPECT_EQ(42, entry.valueU32);
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "fresh", &entry));
+    EXPECT_STREQ("compact", entry.valueStr);
+}
+
+
+TEST_F(MapTest, GarbageCollectionKeepsLatestValuesOfFrequentUpdates)
+{
+    char key[MAP_MAX_KEY_LEN];
+
+    // Many times the reserved space, the log only survives if superseded entries are collected
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i % 8);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, i)) << i;
+    }
+
+    ASSERT_EQ(0, map_add_entry_val_str("name", "resilient"));
+    ASSERT_EQ(0, map_store_all());
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    map_entry_t entry;
+
+    for (uint32_t k = 0; k < 8; k++)
+    {
+        snprintf(key, sizeof(key), "key%u", k);
+        ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, key, &entry)) << key;
+        EXPECT_EQ(20000 - 8 + k, entry.valueU32);
+    }
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "name", &entry));
+    EXPECT_STREQ("resilient", entry.valueStr);
+}
+
+
+TEST_F(MapTest, StatsCountWearAndWriteAmplification)
+{
+    storage_stats_t stats;
+    uint32_t        entryAddr;
+    uint32_t        erases = 0;
+    char            key[MAP_MAX_KEY_LEN];
+    char            payload[8];
+
+    storage_reset_stats();
+
+    // Enough updates to wrap the log, so every sector is erased and collected at least once
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i % 8);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, i)) << i;
+    }
+    ASSERT_EQ(0, map_store_all());
+
+    storage_get_stats(&stats);
+    for (uint32_t sector = 0; sector < STORAGE_NUM_SECTORS; sector++)
+    {
+        EXPECT_LT(0u, stats.sectorErases[sector]) << sector;
+        erases += stats.sectorErases[sector];
+    }
+    EXPECT_LT(0u, erases);
+    EXPECT_LT(0u, stats.gcRuns);
+    EXPECT_LT(0u, stats.flushes);
+    EXPECT_LT(0u, stats.pagePrograms);
+    EXPECT_EQ(0u, stats.crcFailures);
+
+    // Headers, CRCs, GC copies and checkpoints all cost more than the payloads themselves
+    EXPECT_LE(stats.logicalBytesStored, stats.bytesProgrammed);
+    EXPECT_LT(0u, stats.logicalBytesStored);
+
+    storage_reset_stats();
+    ASSERT_EQ(0, storage_store_entry("payload", 8, &entryAddr));
+    ASSERT_EQ(0, storage_flush());
+    ASSERT_EQ(8, storage_retrieve_entry_payload(payload, sizeof(payload), entryAddr));
+
+    storage_get_stats(&stats);
+    EXPECT_EQ(8u, stats.logicalBytesStored);
+    EXPECT_EQ(1u, stats.flushes);
+    EXPECT_EQ(1u, stats.lookups);
+    EXPECT_LT(0u, stats.lookupFlashReads);
+    EXPECT_EQ(stats.lookupFlashReads, stats.flashReads);
+
+    storage_reset_stats();
+    storage_get_stats(&stats);
+    EXPECT_EQ(0u, stats.flashReads);
+    EXPECT_EQ(0u, stats.bytesProgrammed);
+    EXPECT_EQ(0u, stats.sectorErases[0]);
+}
+
+
+TEST_F(MapTest, LazyValuesAreReadBackFromFlash)
+{
+    storage_stats_t stats;
+    map_entry_t     entry;
+
+    ASSERT_EQ(0, map_add_entry_val_str("name", "lazy"));
+    ASSERT_EQ(0, map_add_entry_val_u32("count", 1));
+    ASSERT_EQ(0, map_add_entry_val_u32("count", 2));
+
+    storage_reset_stats();
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "count", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_num(&rtosComponents, 0, &entry));
+    EXPECT_STREQ("name", entry.key);
+    EXPECT_STREQ("lazy", entry.valueStr);
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "missing", &entry));
+    EXPECT_EQ(-1, map_get_entry_via_num(&rtosComponents, 2, &entry));
+
+    // Values held in RAM never touch storage, lazy ones do unless they are cached
+    storage_get_stats(&stats);
+#ifdef MAP_LAZY_VALUES
+    EXPECT_LT(0u, stats.lookups);
+#else
+    EXPECT_EQ(0u, stats.lookups);
+#endif
+}
+
+
+TEST_F(MapTest, CachedValuesFollowUpdates)
+{
+    map_cache_stats_t cacheStats;
+    storage_stats_t   stats;
+    map_entry_t       entry;
+
+    ASSERT_EQ(0, map_add_entry_val_u32("hot", 1));
+    ASSERT_EQ(0, map_add_entry_val_u32("cold", 1));
+
+    storage_reset_stats();
+    map_reset_cache_stats();
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "hot", &entry));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "hot", &entry));
+
+    // Storing a new value finds the key in the cache and keeps it there
+    ASSERT_EQ(0, map_add_entry_val_u32("hot", 2));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "hot", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+
+    map_get_cache_stats(&cacheStats);
+    storage_get_stats(&stats);
+#if defined(MAP_LAZY_VALUES) && (!defined(MAP_CACHE_BYTES) || MAP_CACHE_BYTES > 0)
+    EXPECT_EQ(1u, cacheStats.misses);
+    EXPECT_EQ(3u, cacheStats.hits);
+    EXPECT_EQ(1u, stats.lookups);
+#else
+    // Nothing is cached
+    EXPECT_EQ(0u, cacheStats.misses);
+    EXPECT_EQ(0u, cacheStats.hits);
+#endif
+
+    // Garbage collection moves the cached entries along with their records
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        ASSERT_EQ(0, map_add_entry_val_u32("cold", i));
+    }
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "hot", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "cold", &entry));
+    EXPECT_EQ(19999u, entry.valueU32);
+}
+
+TEST_F(MapTest, CheckpointsAreReplayedOrSkippedOnceStale)
+{
+    char key[MAP_MAX_KEY_LEN];
+
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i % 8);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, i));
+    }
+
+    // Writes a checkpoint, the entries after it are replayed on the next init
+    ASSERT_EQ(0, map_store_all());
+    ASSERT_EQ(0, map_add_entry_val_u32("key0", 1000));
+    ASSERT_EQ(0, map_add_entry_val_str("late", "replayed"));
+    ASSERT_EQ(0, storage_flush());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    map_entry_t entry;
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "key0", &entry));
+    EXPECT_EQ(1000, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "key7", &entry));
+    EXPECT_EQ(199, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "late", &entry));
+    EXPECT_STREQ("replayed", entry.valueStr);
+
+    // Enough updates for the garbage collector to retire the sector the checkpoint points into
+    for (uint32_t i = 0; i < 5000; i++)
+    {
+        snprintf(key, sizeof(key), "key%u", i % 8);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, 2000 + i));
+    }
+    ASSERT_EQ(0, storage_flush());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    for (uint32_t k = 0; k < 8; k++)
+    {
+        snprintf(key, sizeof(key), "key%u", k);
+        ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, key, &entry)) << key;
+        EXPECT_EQ(2000 + 5000 - 8 + k, entry.valueU32);
+    }
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "late", &entry));
+    EXPECT_STREQ("replayed", entry.valueStr);
+}
+
+
+TEST_F(MapTest, HeadSearchHandlesValuesThatLookErased)
+{
+    char erasedLooking[MAP_MAX_VAL_LEN_STR];
+
+    // A long run of 0xFF inside the last entry misleads the binary search for the end of the log
+    memset(erasedLooking, 0xFF, sizeof(erasedLooking) - 1);
+    erasedLooking[sizeof(erasedLooking) - 1] = '\0';
+
+    ASSERT_EQ(0, map_add_entry_val_u32("before", 1));
+    ASSERT_EQ(0, map_add_entry_val_str("blob", erasedLooking));
+    ASSERT_EQ(0, storage_flush());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    ASSERT_EQ(0, map_add_entry_val_u32("after", 2));
+    ASSERT_EQ(0, storage_flush());
+
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    map_entry_t entry;
+
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "before", &entry));
+    EXPECT_EQ(1, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "blob", &entry));
+    EXPECT_STREQ(erasedLooking, entry.valueStr);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "after", &entry));
+    EXPECT_EQ(2, entry.valueU32);
+}
+
+
+TEST_F(MapTest, FlushProgramsOnlyTheAppendedPage)
+{
+    ASSERT_EQ(0, map_add_entry_val_u32("first", 1));
+    ASSERT_EQ(0, storage_flush());
+
+    mx25_flash_reset_page_program_count();
+
+    // The second entry lands in the same page as the first one, nothing else is rewritten
+    ASSERT_EQ(0, map_add_entry_val_u32("second", 2));
+    ASSERT_EQ(0, storage_flush());
+    EXPECT_EQ(1u, mx25_flash_get_page_program_count());
+
+    ASSERT_EQ(0, storage_flush());
+    EXPECT_EQ(1u, mx25_flash_get_page_program_count());
+}
+
+
+TEST_F(MapTest, BatchOfEntriesIsCommittedWithOneFlush)
+{
+    std::vector<std::string> keys;
+    std::vector<map_kv_t>    batch;
+
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        keys.push_back("cfg" + std::to_string(i));
+    }
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        batch.push_back({keys[i].c_str(), (i % 2) ? "on" : NULL, i});
+    }
+
+    ASSERT_EQ(0, map_add_entry_val_u32("first", 1));
+    ASSERT_EQ(0, storage_flush());
+    mx25_flash_reset_page_program_count();
+
+    ASSERT_EQ(0, map_add_entries(batch.data(), batch.size()));
+
+    // 50 records of 14 to 15 bytes, programmed page by page in one flush
+    EXPECT_LE(mx25_flash_get_page_program_count(), 4u);
+
+    // A key that is too long rejects the whole batch
+    map_kv_t bad[2] = {{"cfg0", NULL, 1000}, {"a_key_that_is_way_too_long_to_fit_in_map", NULL, 0}};
+    EXPECT_EQ(-1, map_add_entries(bad, 2));
+
+    ASSERT_EQ(0, map_deInit(&rtosComponents));
+    ASSERT_EQ(0, map_init(&rtosComponents));
+
+    map_entry_t entry;
+
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, keys[i].c_str(), &entry)) << keys[i];
+        if (i % 2)
+        {
+            EXPECT_STREQ("on", entry.valueStr);
+        }
+        else
+        {
+            EXPECT_EQ(i, entry.valueU32);
+        }
+    }
+}
+
+TEST_F(MapTest, BatchSurvivesGarbageCollectionInTheMiddle)
+{
+    char            key[MAP_MAX_KEY_LEN];
+    map_entry_t     entry;
+    storage_stats_t stats;
+
+    // The first record of K sits in the oldest sector, the fillers leave the log one sector short of full
+    ASSERT_EQ(0, map_add_entry_val_u32("K", 1));
+    ASSERT_EQ(0, map_store_all());
+    for (uint32_t i = 0; i < 725; i++)
+    {
+        snprintf(key, sizeof(key), "fill%u", i % 8);
+        ASSERT_EQ(0, map_add_entry_val_str(key, "abcdefghijklmnopqrstuvwx"));
+    }
+    ASSERT_EQ(0, map_store_all());
+
+    // The batch opens a new sector after its first record, collecting the sector holding the old K
+    std::vector<map_kv_t> batch = {{"K", NULL, 2}};
+    for (uint32_t i = 0; i < 7; i++)
+    {
+        batch.push_back({"fill0", "abcdefghijklmnopqrstuvwx", 0});
+    }
+
+    storage_reset_stats();
+    ASSERT_EQ(0, map_add_entries(batch.data(), batch.size()));
+    storage_get_stats(&stats);
+    ASSERT_GE(stats.gcRuns, 1u);
+
+    // The old K was superseded when the collector ran, no copy of it outlives the batch
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "K", &entry));
+    EXPECT_EQ(2u, entry.valueU32);
+}
+
+TEST_F(MapTest, FullMapRejectsNewKeysBeforeStoringThem)
+{
+    char        key[MAP_MAX_KEY_LEN];
+    map_entry_t entry;
+
+    for (uint32_t k = 0; k < MAP_MAX_KEYS; k++)
+    {
+        snprintf(key, sizeof(key), "k%u", k);
+        ASSERT_EQ(0, map_add_entry_val_u32(key, k));
+    }
+    ASSERT_EQ(0, map_store_all());
+
+    // A new key is refused, alone, in a batch or in a transaction, updates of known keys still go through
+    map_kv_t batch[2] = {{"k0", NULL, 1000}, {"extra", NULL, 0}};
+    EXPECT_EQ(-1, map_add_entry_val_u32("extra", 1));
+    EXPECT_EQ(-1, map_add_entries(batch, 2));
+    ASSERT_EQ(0, map_tx_begin());
+    EXPECT_EQ(-1, map_add_entry_val_u32("extra", 2));
+    EXPECT_EQ(0, map_add_entry_val_u32("k2", 2000));
+    ASSERT_EQ(0, map_tx_commit());
+    ASSERT_EQ(0, map_add_entry_val_u32("k1", 1001));
+    ASSERT_EQ(0, map_store_all());
+
+    // None of the refused entries reached flash, so the log still reads back
+    _reset_storage_state();
+    ASSERT_EQ(0, map_read_log(&rtosComponents));
+
+    EXPECT_EQ(-1, map_get_entry_via_key(&rtosComponents, "extra", &entry));
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "k0", &entry));
+    EXPECT_EQ(0u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "k1", &entry));
+    EXPECT_EQ(1001u, entry.valueU32);
+    ASSERT_EQ(0, map_get_entry_via_key(&rtosComponents, "k2", &entry));
+    EXPECT_EQ(2000u, entry.valueU32);
+
+    // Deleting a key makes room for a new one
+    ASSERT_EQ(0, map_delete_entry(&rtosComponents, "k3"));
+    EXPECT_EQ(0, map_add_entry_val_u32("extra", 3));
+}